@@ -0,0 +1,271 @@
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <fstream>
+#include <fcntl.h>
+#include "mysql.hpp"
+
+// Microbenchmarks run on rows built in memory, so they need no server. The
+// end-to-end ones run only when MYSQL_BENCH_HOST is set, against
+// MYSQL_BENCH_DB (default "test") as MYSQL_BENCH_USER/MYSQL_BENCH_PASSWORD,
+// in a scratch table they create and drop.
+
+typedef std::chrono::steady_clock bench_clock;
+
+template <class T>
+inline void keep(const T& x) {
+    asm volatile("" : : "g"(&x) : "memory");
+}
+
+// Run f(i) for i in [0, n) repeatedly until it has taken 200ms and print
+// the mean time per call and calls per second.
+template <class F>
+void run(const char* name, size_t n, F f) {
+    size_t calls = 0;
+    bench_clock::duration spent{};
+    while (spent < std::chrono::milliseconds(200)) {
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < n; i++) f(i);
+        spent += bench_clock::now() - start;
+        calls += n;
+    }
+    double ns = std::chrono::duration<double, std::nano>(spent).count() / calls;
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(1) << ns << " ns/op"
+              << std::setw(14) << std::setprecision(0) << 1e9 / ns << " op/s\n";
+}
+
+// Text-protocol rows as libmysqlclient hands them out: NUL-terminated
+// cells with a parallel array of lengths.
+struct MockRows {
+    std::vector<std::string> names;
+    std::vector<MYSQL_FIELD> fields;
+    std::vector<std::string> cells;
+    std::vector<char*> ptrs;
+    std::vector<unsigned long> lengths;
+    size_t columns;
+
+    MockRows(size_t rows, size_t columns) : columns(columns) {
+        std::mt19937 gen(42);
+        for (size_t c = 0; c < columns; c++) names.push_back("column_" + std::to_string(c));
+        fields.resize(columns);
+        for (size_t c = 0; c < columns; c++) {
+            memset(&fields[c], 0, sizeof(MYSQL_FIELD));
+            fields[c].name = (char*)names[c].c_str();
+            fields[c].name_length = names[c].size();
+        }
+        for (size_t r = 0; r < rows; r++) {
+            for (size_t c = 0; c < columns; c++) {
+                if (c % 2 == 0) cells.push_back(std::to_string(gen() % 100000000));
+                else cells.push_back(std::string(8 + gen() % 24, 'a' + gen() % 26));
+            }
+        }
+        for (std::string& s : cells) {
+            ptrs.push_back(&s[0]);
+            lengths.push_back(s.size());
+        }
+    }
+
+    size_t size() const {
+        return ptrs.size() / columns;
+    }
+
+    Row row(size_t r) {
+        return Row{&ptrs[r * columns], &lengths[r * columns]};
+    }
+};
+
+void bench_rows() {
+    MockRows rows(1024, 8);
+    ColumnLayout layout(rows.fields.data(), rows.columns);
+    size_t n = rows.size();
+
+    run("Row::operator[] (8 columns)", n, [&](size_t i) {
+        Row row = rows.row(i);
+        for (size_t c = 0; c < 8; c++) keep(row[c]);
+    });
+    run("Row::view (8 columns)", n, [&](size_t i) {
+        Row row = rows.row(i);
+        for (size_t c = 0; c < 8; c++) keep(row.view(c));
+    });
+    run("std::stoi(row[c]) (4 columns)", n, [&](size_t i) {
+        Row row = rows.row(i);
+        for (size_t c = 0; c < 8; c += 2) keep(std::stoi(row[c]));
+    });
+    run("Row::get<int> (4 columns)", n, [&](size_t i) {
+        Row row = rows.row(i);
+        for (size_t c = 0; c < 8; c += 2) keep(row.get<int>(c));
+    });
+    run("Result::fetch_array map (8 columns)", n, [&](size_t i) {
+        keep(Result::to_map(rows.row(i), layout));
+    });
+    run("NamedRow::view by name (8 columns)", n, [&](size_t i) {
+        NamedRow row(rows.row(i), &layout);
+        for (size_t c = 0; c < 8; c++) keep(row.view(rows.names[c]));
+    });
+    run("RowSet::append (8 columns)", n, [&](size_t i) {
+        static RowSet set;
+        if (i == 0) set = RowSet(std::make_shared<ColumnLayout>(rows.fields.data(), rows.columns));
+        set.append(&rows.ptrs[i * 8], &rows.lengths[i * 8]);
+    });
+
+    std::ofstream devnull("/dev/null");
+    run("ostream << row[c] << '\\t' (8 columns)", n, [&](size_t i) {
+        Row row = rows.row(i);
+        for (size_t c = 0; c < 8; c++) devnull << row[c] << (c == 7 ? '\n' : '\t');
+    });
+    int fd = open("/dev/null", O_WRONLY);
+    {
+        Exporter out(fd);
+        run("Exporter::row, TSV (8 columns)", n, [&](size_t i) {
+            out.row(rows.row(i), 8);
+        });
+    }
+    close(fd);
+}
+
+void bench_escape() {
+    std::vector<std::string> plain, quoted;
+    std::mt19937 gen(7);
+    for (size_t i = 0; i < 256; i++) {
+        std::string s(16 + gen() % 240, 'x');
+        for (char& c : s) c = 'a' + gen() % 26;
+        plain.push_back(s);
+        s[gen() % s.size()] = '\'';
+        quoted.push_back(s);
+    }
+    mysql db;
+    std::string out;
+    run("escape_string (no specials)", plain.size(), [&](size_t i) {
+        keep(escape_string(plain[i]));
+    });
+    run("escape_string (one quote)", quoted.size(), [&](size_t i) {
+        keep(escape_string(quoted[i]));
+    });
+    run("mysql::escape (no specials)", plain.size(), [&](size_t i) {
+        out.clear();
+        db.escape(plain[i], out);
+        keep(out);
+    });
+    run("mysql::escape (one quote)", quoted.size(), [&](size_t i) {
+        out.clear();
+        db.escape(quoted[i], out);
+        keep(out);
+    });
+}
+
+const char* env(const char* name, const char* fallback) {
+    const char* x = getenv(name);
+    return x ? x : fallback;
+}
+
+// rows per second, timed once over n rows
+template <class F>
+void throughput(const char* name, size_t n, F f) {
+    bench_clock::time_point start = bench_clock::now();
+    if (!f()) {
+        std::cout << std::left << std::setw(40) << name << " failed\n";
+        return;
+    }
+    double s = std::chrono::duration<double>(bench_clock::now() - start).count();
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(0) << n / s << " rows/s\n";
+}
+
+void bench_server() {
+    if (!getenv("MYSQL_BENCH_HOST")) {
+        std::cout << "MYSQL_BENCH_HOST not set, skipping server benchmarks\n";
+        return;
+    }
+    mysql sql;
+    if (!sql.connect(env("MYSQL_BENCH_HOST", ""), env("MYSQL_BENCH_USER", "test"), env("MYSQL_BENCH_PASSWORD", "test"),
+                     env("MYSQL_BENCH_DB", "test"), atoi(env("MYSQL_BENCH_PORT", "0")), nullptr, CLIENT_LOCAL_FILES)) {
+        return;
+    }
+    const size_t n = 20000;
+    std::vector<std::tuple<int, std::string>> rows;
+    for (size_t i = 0; i < n; i++) rows.emplace_back(i, "name_" + std::to_string(i));
+
+    sql.query("DROP TABLE IF EXISTS `bench_rows`");
+    sql.query("CREATE TABLE `bench_rows` (`id` INT NOT NULL, `name` VARCHAR(64) NOT NULL)");
+    Stmt insert = sql.prepare("INSERT INTO `bench_rows` (`id`, `name`) VALUES (?, ?)");
+    if (!insert) return;
+
+    run("Stmt::bind (int, string)", n, [&](size_t i) {
+        insert.bind(std::get<0>(rows[i]), std::get<1>(rows[i]));
+    });
+
+    throughput("insert, one execute per row", n, [&]() {
+        for (const auto& row : rows) {
+            if (!insert.execute(std::get<0>(row), std::get<1>(row))) return false;
+        }
+        return true;
+    });
+    sql.query("TRUNCATE TABLE `bench_rows`");
+
+    throughput("insert, Stmt::execute_batch", n, [&]() {
+        return insert.execute_batch(rows) == (long long)n;
+    });
+    sql.query("TRUNCATE TABLE `bench_rows`");
+
+    // needs local_infile enabled on the server
+    throughput("insert, bulk_load", n, [&]() {
+        return sql.bulk_load("bench_rows", {"id", "name"}, rows) == (long long)n;
+    });
+    sql.query("TRUNCATE TABLE `bench_rows`");
+
+    throughput("insert, pipelined Batch of 100", n, [&]() {
+        for (size_t i = 0; i < n; i += 100) {
+            Batch batch;
+            for (size_t j = i; j < i + 100 && j < n; j++) {
+                std::string q = "INSERT INTO `bench_rows` (`id`, `name`) VALUES (";
+                q += std::to_string(std::get<0>(rows[j])) + ", '";
+                sql.escape(std::get<1>(rows[j]), q);
+                q += "')";
+                batch.add(q);
+            }
+            for (const BatchResult& r : sql.execute(batch)) {
+                if (r.error || !r.executed) return false;
+            }
+        }
+        return true;
+    });
+
+    throughput("select, Row::view streaming", n, [&]() {
+        Result r = sql.query("SELECT `id`, `name` FROM `bench_rows`");
+        size_t seen = 0;
+        for (Row row : r) {
+            keep(row.view(1));
+            seen++;
+        }
+        return seen == n;
+    });
+    throughput("select, fetch_array", n, [&]() {
+        Result r = sql.query("SELECT `id`, `name` FROM `bench_rows`");
+        size_t seen = 0;
+        while (!r.fetch_array().empty()) seen++;
+        return seen == n;
+    });
+    throughput("select, typed Stmt::rows", n, [&]() {
+        Stmt s = sql.prepare("SELECT `id`, `name` FROM `bench_rows`");
+        if (!s.execute()) return false;
+        size_t seen = 0;
+        for (auto& row : s.rows<int, std::string>()) {
+            keep(row);
+            seen++;
+        }
+        return seen == n;
+    });
+
+    sql.query("DROP TABLE `bench_rows`");
+}
+
+int main()
+{
+    bench_rows();
+    bench_escape();
+    bench_server();
+}
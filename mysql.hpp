@@ -3,308 +3,5926 @@
 
 #include <iostream>
 #include <cstring>
+#include <cctype>
+#include <strings.h>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <memory>
+#include <chrono>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <tuple>
+#include <utility>
+#include <array>
+#include <optional>
+#include <ctime>
+#include <cstdlib>
+#include <cstdint>
+#include <charconv>
+#include <limits>
+#include <type_traits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <functional>
+#include <cerrno>
+#include <climits>
+#include <cassert>
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#if defined(__linux__) && defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define MYSQL_HPP_COROUTINES 1
+#endif
+
+// MySQL 8.0 dropped my_bool in favour of bool
+#if !defined(MARIADB_PACKAGE_VERSION_ID) && MYSQL_VERSION_ID >= 80001
+typedef bool my_bool;
+#endif
+
+// which nonblocking client API the async operations are built on
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+#define MYSQL_HPP_ASYNC_MARIADB 1
+#elif MYSQL_VERSION_ID >= 80016
+#define MYSQL_HPP_ASYNC_MYSQL 1
+#endif
+
+class mysql;
+class Stmt;
+class Result;
+class RowSet;
+class ResultCache;
+class LoadWriter;
+template <class... Types> class StmtRows;
+class AsyncConnect;
+class AsyncQuery;
+class AsyncFetch;
+class AsyncPrepare;
+class AsyncExecute;
+class EventLoop;
+template <class Op> class Awaitable;
+class StreamAwaitable;
+class Batch;
+struct BatchResult;
+
+// streaming keeps the connection busy until the result is drained;
+// buffered reads it all client-side first and frees the connection
+enum class ResultMode { streaming, buffered };
+
+enum class QueryKind { connect, query, prepare, execute };
+
+// What one operation cost, handed to a QueryObserver when it finishes.
+// Phases that don't apply to the operation stay zero.
+struct QueryStats {
+    typedef std::chrono::steady_clock::duration duration;
+
+    QueryKind kind = QueryKind::query;
+    // statement text, valid for the duration of the callback
+    std::string_view sql;
+    // waiting for the connection's mutex
+    duration lock_wait{};
+    // writing the statement or its parameters to the server
+    duration send{};
+    // from the end of the send until the server's response arrived
+    duration server{};
+    // from the response to the first row of a streaming result
+    duration first_row{};
+    // reading the remaining rows
+    duration drain{};
+    duration total{};
+    // statement text or parameter payload, and row payload
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    // rows returned, or affected for statements without a result set
+    uint64_t rows = 0;
+    unsigned int error = 0;
+    const char* message = "";
+};
+
+// Receives QueryStats for every operation on the connections it is set on,
+// in the thread that ran the operation. While an observer is set, errors
+// are reported to it instead of std::cerr. It must not use the connection
+// it is called for.
+class QueryObserver {
+    public:
+        virtual ~QueryObserver() {}
+        virtual void observe(const QueryStats& stats) = 0;
+};
+
+// Fills in a QueryStats one phase at a time; free when there is no
+// observer, as the clock is never read.
+class QueryTimer {
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        QueryObserver* observer;
+        clock::time_point start;
+        clock::time_point mark;
+    public:
+        QueryStats stats;
+
+        QueryTimer(QueryObserver* observer, QueryKind kind, std::string_view sql) : observer(observer) {
+            if (!observer) return;
+            stats.kind = kind;
+            stats.sql  = sql;
+            start = mark = clock::now();
+        }
+
+        explicit operator bool() const {
+            return observer != nullptr;
+        }
+
+        // time since the previous lap goes to phase
+        void lap(QueryStats::duration& phase) {
+            if (!observer) return;
+            clock::time_point now = clock::now();
+            phase = now - mark;
+            mark  = now;
+        }
+
+        // reports to the observer, or to std::cerr without one
+        void fail(unsigned int error, const char* message) {
+            if (!observer) {
+                std::cerr << "Error: " << message << "\n";
+                return;
+            }
+            stats.error   = error;
+            stats.message = message;
+        }
+
+        void finish() {
+            if (!observer) return;
+            stats.total = clock::now() - start;
+            observer->observe(stats);
+            observer = nullptr;
+        }
+};
+
+// QueryObserver aggregating per statement text: counts, rows, bytes, the
+// summed time of each phase and a histogram of the total, from which
+// percentiles are read. Buckets are a quarter of a power of two wide, so
+// a percentile is within 25% of the true value.
+class LatencyHistogram : public QueryObserver {
+    public:
+        static const size_t buckets = 252;
+
+        struct Entry {
+            std::string sql;
+            QueryKind kind = QueryKind::query;
+            uint64_t count = 0;
+            uint64_t errors = 0;
+            uint64_t rows = 0;
+            uint64_t bytes_sent = 0;
+            uint64_t bytes_received = 0;
+            QueryStats::duration lock_wait{};
+            QueryStats::duration send{};
+            QueryStats::duration server{};
+            QueryStats::duration first_row{};
+            QueryStats::duration drain{};
+            std::array<uint64_t, buckets> total{};
+
+            // upper bound of the p-quantile of total, p in [0, 1]
+            QueryStats::duration percentile(double p) const {
+                if (count == 0) return QueryStats::duration::zero();
+                uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p * count + 0.5));
+                uint64_t seen = 0;
+                for (size_t b = 0; b < buckets; b++) {
+                    seen += total[b];
+                    if (seen >= rank) return std::chrono::nanoseconds(upper(b));
+                }
+                return std::chrono::nanoseconds(upper(buckets - 1));
+            }
+        };
+
+        // statements beyond the first max_statements distinct ones are
+        // counted together under an empty sql
+        explicit LatencyHistogram(size_t max_statements = 1024) : max_statements(max_statements) {}
+
+        void observe(const QueryStats& s) override {
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(s.total).count();
+            std::lock_guard<std::mutex> mg(mutex);
+            Entry& e = entry(s.sql);
+            e.kind = s.kind;
+            e.count++;
+            e.errors += s.error != 0;
+            e.rows   += s.rows;
+            e.bytes_sent     += s.bytes_sent;
+            e.bytes_received += s.bytes_received;
+            e.lock_wait += s.lock_wait;
+            e.send      += s.send;
+            e.server    += s.server;
+            e.first_row += s.first_row;
+            e.drain     += s.drain;
+            e.total[bucket(ns)]++;
+        }
+
+        QueryStats::duration percentile(std::string_view sql, double p) const {
+            std::lock_guard<std::mutex> mg(mutex);
+            for (size_t h = std::hash<std::string_view>()(sql);; h++) {
+                auto it = entries.find(h);
+                if (it == entries.end()) return QueryStats::duration::zero();
+                if (it->second.sql == sql) return it->second.percentile(p);
+            }
+        }
+
+        std::vector<Entry> snapshot() const {
+            std::lock_guard<std::mutex> mg(mutex);
+            std::vector<Entry> out;
+            out.reserve(entries.size());
+            for (const auto& e : entries) out.push_back(e.second);
+            return out;
+        }
+
+        // one line per statement, highest p99 first
+        void report(std::ostream& out) const {
+            std::vector<Entry> all = snapshot();
+            std::vector<std::pair<QueryStats::duration, const Entry*>> order;
+            for (const Entry& e : all) order.emplace_back(e.percentile(0.99), &e);
+            std::sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+            for (const auto& x : order) {
+                const Entry& e = *x.second;
+                auto us = [](QueryStats::duration d) {
+                    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+                };
+                out << "count=" << e.count << " errors=" << e.errors
+                    << " p50=" << us(e.percentile(0.5)) << "us p99=" << us(x.first) << "us"
+                    << " p999=" << us(e.percentile(0.999)) << "us rows=" << e.rows
+                    << " sent=" << e.bytes_sent << " received=" << e.bytes_received
+                    << "\t" << e.sql << "\n";
+            }
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> mg(mutex);
+            entries.clear();
+        }
+
+        static size_t bucket(uint64_t ns) {
+            if (ns < 4) return ns;
+            int msb = 63 - __builtin_clzll(ns);
+            return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+        }
+
+        static uint64_t upper(size_t b) {
+            if (b < 4) return b;
+            int msb = b / 4 + 1;
+            uint64_t lower = (1ULL << msb) | (uint64_t(b % 4) << (msb - 2));
+            return lower + (1ULL << (msb - 2)) - 1;
+        }
+
+    private:
+        mutable std::mutex mutex;
+        size_t max_statements;
+        // keyed by hash of the text, probing on from collisions, so a hit
+        // doesn't allocate
+        std::unordered_map<size_t, Entry> entries;
+
+        Entry& entry(std::string_view sql) {
+            size_t h = std::hash<std::string_view>()(sql);
+            for (;; h++) {
+                auto it = entries.find(h);
+                if (it == entries.end()) break;
+                if (it->second.sql == sql) return it->second;
+            }
+            if (entries.size() >= max_statements && !sql.empty()) return entry(std::string_view());
+            Entry& e = entries[h];
+            e.sql = std::string(sql);
+            return e;
+        }
+};
+
+inline
+std::string escape_string(const std::string& val) {
+    std::string result;
+    result.reserve(val.size() + val.size() / 8 + 8);
+    size_t plain = 0;
+    for(size_t i = 0; i < val.length(); ++i) {
+        switch(val[i]) {
+            case '\'': case '\n' : case '\r': case '\t': case '\v': case '\f': case '\\': case '"': {
+                result.append(val, plain, i - plain);
+                plain = i + 1;
+                if (i == 0 || val[i - 1] != '\\') { result.append(1, '\\'); }
+                if (val[i] == '\n') { result += "\\n"; }
+                else if (val[i] == '\r') { result += "\\r"; }
+                else if (val[i] == '\t') { result += "\\t"; }
+                else if (val[i] == '\f') { result += "\\f"; }
+                else if (val[i] == '\v') { result += "\\v"; }
+                else { result.append(1, val[i]); }
+            } break;
+            default: break;
+        }
+    }
+    result.append(val, plain, std::string::npos);
+    return result;
+}
+
+// needs_escape() a byte at a time, also for what SSE2 leaves over
+inline
+bool needs_escape_scalar(const char* s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        switch (s[i]) {
+            case '\0': case '\n': case '\r': case '\\': case '\'': case '"': case '`': case '\032':
+                return true;
+            default: break;
+        }
+    }
+    return false;
+}
+
+// Whether mysql_real_escape_string would change s. Checks 16 bytes at a
+// time with SSE2 where available.
+inline
+bool needs_escape(const char* s, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i nl  = _mm_set1_epi8('\n');
+    const __m128i cr  = _mm_set1_epi8('\r');
+    const __m128i bs  = _mm_set1_epi8('\\');
+    const __m128i sq  = _mm_set1_epi8('\'');
+    const __m128i dq  = _mm_set1_epi8('"');
+    const __m128i bt  = _mm_set1_epi8('`');
+    const __m128i sub = _mm_set1_epi8('\032');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_cmpeq_epi8(v, nl)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, bs))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sq), _mm_cmpeq_epi8(v, dq)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, bt), _mm_cmpeq_epi8(v, sub))));
+        if (_mm_movemask_epi8(m)) return true;
+    }
+#endif
+    return needs_escape_scalar(s + i, n - i);
+}
+
+// Whether a client error means the connection itself is gone, as opposed
+// to the statement failing.
+inline
+bool connection_lost(unsigned int err) {
+    switch (err) {
+        case CR_SERVER_GONE_ERROR:
+        case CR_SERVER_LOST:
+        case CR_CONNECTION_ERROR:
+        case CR_CONN_HOST_ERROR:
+#ifdef CR_SERVER_LOST_EXTENDED
+        case CR_SERVER_LOST_EXTENDED:
+#endif
+        // ER_CLIENT_INTERACTION_TIMEOUT, sent by MySQL 8.0.24+ before it
+        // closes an idle connection
+        case 4031:
+            return true;
+        default:
+            return false;
+    }
+}
+
+enum class Compression { none, zlib, zstd };
+
+enum class SslMode { preferred, disabled, required, verify_ca, verify_identity };
+
+// Transport settings for mysql::connect, set with mysql_options() before
+// the handshake. The defaults leave the client library's own in place.
+struct ConnectOptions {
+    // zstd needs MySQL 8.0.18+ on both ends; the server picks zlib if it
+    // has no zstd, and older clients and MariaDB always use zlib
+    Compression compression = Compression::none;
+    // 1 (fastest) to 22
+    unsigned int zstd_level = 3;
+    // Zero for the library default. The library counts whole seconds, so
+    // these are rounded up, and MySQL retries a timed out read twice
+    // before failing the call.
+    std::chrono::milliseconds connect_timeout{0};
+    std::chrono::milliseconds read_timeout{0};
+    std::chrono::milliseconds write_timeout{0};
+    // TCP only: true sends small packets at once instead of coalescing
+    // them, false turns Nagle's algorithm back on. Both client libraries
+    // already set TCP_NODELAY, so unset leaves the socket alone.
+    std::optional<bool> tcp_nodelay;
+    SslMode ssl = SslMode::preferred;
+    // CA certificate file, for verify_ca and verify_identity
+    std::string ssl_ca;
+    // allow LOAD DATA LOCAL INFILE, as passing CLIENT_LOCAL_FILES does
+    bool local_infile = false;
+};
+
+// How mysql::reconnect() retries, see mysql::set_reconnect
+struct ReconnectOptions {
+    unsigned int attempts = 5;
+    // waited after the first failed attempt, doubling after each one
+    std::chrono::milliseconds initial_backoff = std::chrono::milliseconds(50);
+    std::chrono::milliseconds max_backoff = std::chrono::seconds(2);
+};
+
+// Apply the options of o that take effect at connect time to an
+// unconnected handle about to connect with client_flag. False, after
+// reporting it, if the client library rejected one.
+inline
+bool set_connect_options(MYSQL* handle, const ConnectOptions& o, unsigned long client_flag) {
+    bool ok = true;
+    auto set = [&](enum mysql_option option, const void* value, const char* name) {
+        if (mysql_options(handle, option, value) != 0) {
+            std::cerr << "Error: client library rejected " << name << "\n";
+            ok = false;
+        }
+    };
+    auto seconds = [](std::chrono::milliseconds t) {
+        return (unsigned int)((t.count() + 999) / 1000);
+    };
+    if (o.compression != Compression::none) {
+#if !defined(MARIADB_PACKAGE_VERSION_ID) && MYSQL_VERSION_ID >= 80018
+        set(MYSQL_OPT_COMPRESSION_ALGORITHMS, o.compression == Compression::zstd ? "zstd,zlib" : "zlib",
+            "compression algorithms");
+        if (o.compression == Compression::zstd) {
+            unsigned int level = o.zstd_level;
+            set(MYSQL_OPT_ZSTD_COMPRESSION_LEVEL, &level, "zstd level");
+        }
+#else
+        set(MYSQL_OPT_COMPRESS, nullptr, "compression");
+#endif
+    }
+    unsigned int t;
+    if (o.connect_timeout.count() > 0) {
+        t = seconds(o.connect_timeout);
+        set(MYSQL_OPT_CONNECT_TIMEOUT, &t, "connect timeout");
+    }
+    if (o.read_timeout.count() > 0) {
+        t = seconds(o.read_timeout);
+        set(MYSQL_OPT_READ_TIMEOUT, &t, "read timeout");
+    }
+    if (o.write_timeout.count() > 0) {
+        t = seconds(o.write_timeout);
+        set(MYSQL_OPT_WRITE_TIMEOUT, &t, "write timeout");
+    }
+    if (!o.ssl_ca.empty()) set(MYSQL_OPT_SSL_CA, o.ssl_ca.c_str(), "SSL CA");
+    if (o.ssl != SslMode::preferred) {
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+        // Connector/C only uses TLS when asked to
+        my_bool on = 1;
+        if (o.ssl != SslMode::disabled) set(MYSQL_OPT_SSL_ENFORCE, &on, "SSL mode");
+        if (o.ssl == SslMode::verify_ca || o.ssl == SslMode::verify_identity) {
+            set(MYSQL_OPT_SSL_VERIFY_SERVER_CERT, &on, "SSL verification");
+        }
+#elif MYSQL_VERSION_ID >= 50711
+        unsigned int mode = o.ssl == SslMode::disabled  ? SSL_MODE_DISABLED
+                          : o.ssl == SslMode::required  ? SSL_MODE_REQUIRED
+                          : o.ssl == SslMode::verify_ca ? SSL_MODE_VERIFY_CA
+                          : SSL_MODE_VERIFY_IDENTITY;
+        set(MYSQL_OPT_SSL_MODE, &mode, "SSL mode");
+#else
+        std::cerr << "Error: client library has no SSL mode\n";
+        ok = false;
+#endif
+    }
+    if (o.local_infile || (client_flag & CLIENT_LOCAL_FILES)) {
+        // newer clients refuse LOCAL INFILE requests unless this is set too
+        unsigned int on = 1;
+        set(MYSQL_OPT_LOCAL_INFILE, &on, "local infile");
+    }
+    return ok;
+}
+
+// The thread a thread-affine connection belongs to, or none. Checked with
+// assert(), so the checks compile away under NDEBUG.
+class ThreadOwner {
+    private:
+        std::atomic<std::thread::id> id;
+    public:
+        void bind() {
+            id.store(std::this_thread::get_id(), std::memory_order_relaxed);
+        }
+        void unbind() {
+            id.store(std::thread::id(), std::memory_order_relaxed);
+        }
+        bool bound() const {
+            return id.load(std::memory_order_relaxed) != std::thread::id();
+        }
+        void check() const {
+            assert((!bound() || id.load(std::memory_order_relaxed) == std::this_thread::get_id())
+                   && "thread-affine connection used from another thread");
+        }
+};
+
+class mysql {
+    public:
+        mysql() : handle(mysql_init(0)), stmt_cache_size(32), multi_statements(false), observer(nullptr),
+                  alive(std::make_shared<std::atomic<bool>>(false)), cache(nullptr), auto_reconnect(false),
+                  reconnecting(false) {}
+
+        ~mysql() {
+            close();
+        }
+
+        bool connect(
+                const char* host, const char* user, const char* password,
+                const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag,
+                const ConnectOptions& options = ConnectOptions()) {
+            QueryTimer timer(observer, QueryKind::connect, host ? host : "");
+            Guard mg(*this);
+            timer.lap(timer.stats.lock_wait);
+            target.reset(new Target{host ? host : "", user ? user : "", password ? password : "", db ? db : "",
+                                    port, unix_socket ? unix_socket : "", client_flag, options});
+            drop_stmt_cache();
+            return connect_unlocked(timer);
+        }
+        void close() {
+            Guard mg(*this);
+            close_unlocked();
+        }
+        // Whether the connection is believed usable: connected, and no call
+        // since has failed with a lost-connection error. No round trip; use
+        // ping() to ask the server. Takes the mutex, as a reconnect
+        // replaces both the handle and the flag.
+        bool is_open() const {
+            Guard mg(*this);
+            return is_open_unlocked();
+        }
+
+        // round trip to the server, updating is_open()
+        bool ping() {
+            Guard mg(*this);
+            if (handle == nullptr) return false;
+            bool ok = mysql_ping(handle) == 0;
+            *alive = ok;
+            return ok;
+        }
+
+        // Clear what a user of the connection may have left behind, before
+        // it is handed to another: further results of a multi-statement
+        // query, and an open transaction. With full, also session and user
+        // variables, temporary tables, locks and prepared statements, with
+        // mysql_reset_connection: statements go stale, and the statement
+        // cache and set_session() variables are forgotten. False if the
+        // connection is not fit for reuse, e.g. with rows still unread.
+        bool reset(bool full = false) {
+            Guard mg(*this);
+            if (!is_open_unlocked()) return false;
+            while (mysql_more_results(handle)) {
+                if (mysql_next_result(handle) > 0) {
+                    note_error(mysql_errno(handle));
+                    return false;
+                }
+                if (MYSQL_RES* res = mysql_store_result(handle)) mysql_free_result(res);
+            }
+#if defined(MARIADB_PACKAGE_VERSION_ID) || MYSQL_VERSION_ID >= 50703
+            if (full) {
+                if (mysql_reset_connection(handle) != 0) {
+                    note_error(mysql_errno(handle));
+                    return false;
+                }
+                *alive = false;
+                alive = std::make_shared<std::atomic<bool>>(true);
+                drop_stmt_cache();
+                unprepared.clear();
+                session.clear();
+                session_scope.clear();
+                return true;
+            }
+#endif
+            const char q[] = "ROLLBACK";
+            if (mysql_real_query(handle, q, sizeof(q) - 1) != 0) {
+                note_error(mysql_errno(handle));
+                return false;
+            }
+            return true;
+        }
+
+        // Connect again with the arguments of the last connect(), retrying
+        // with exponential backoff as set by set_reconnect(). Session
+        // variables set with set_session() are set again and the statement
+        // cache is prepared again before it returns; statements prepared
+        // before are stale(). Other calls on the connection wait until it
+        // is done, backoff included. False, leaving the connection closed,
+        // once the attempts are used up or if connect() was never called.
+        bool reconnect() {
+            Guard mg(*this);
+            return reconnect_unlocked();
+        }
+
+        // Also reconnect() automatically in the first query, prepare or
+        // batch after the connection was lost. The call that found the
+        // connection lost still fails, as it may have run on the server.
+        void set_reconnect(const ReconnectOptions& options, bool automatic = true) {
+            Guard mg(*this);
+            retry = options;
+            auto_reconnect = automatic;
+        }
+
+        // Run SET SESSION name = value, and again after every reconnect().
+        // name is a variable name, letters, digits, '_' and '.' only. value
+        // is sent as is, an SQL expression such as 'UTC' or 1: quote and
+        // escape() strings that come from outside.
+        bool set_session(const std::string& name, const std::string& value) {
+            if (name.empty() || !std::all_of(name.begin(), name.end(), [](char c) {
+                    return std::isalnum((unsigned char)c) || c == '_' || c == '.';
+                })) {
+                std::cerr << "Error: invalid session variable name: " << name << "\n";
+                return false;
+            }
+            std::string q = "SET SESSION " + name + " = " + value;
+            Guard mg(*this);
+            revive();
+            if (!handle || mysql_real_query(handle, q.c_str(), q.size()) != 0) {
+                if (handle) {
+                    note_error(mysql_errno(handle));
+                    std::cerr << "Error: " << mysql_error(handle) << "\n";
+                }
+                return false;
+            }
+            auto it = std::find_if(session.begin(), session.end(), [&](const std::pair<std::string, std::string>& x) {
+                return x.first == name;
+            });
+            if (it != session.end()) it->second = value;
+            else session.emplace_back(name, value);
+            session_scope.clear();
+            for (const auto& v : session) session_scope += v.first + " = " + v.second + ", ";
+            return true;
+        }
+        // Append in to out escaped for use inside a quote-delimited SQL
+        // string, honouring the connection's character set. Returns the
+        // number of bytes appended; input needing no escaping is copied as is.
+        // With quote '`', for an identifier, backquotes are doubled and
+        // nothing else is touched.
+        size_t escape(std::string_view in, std::string& out, char quote = '\'') const {
+            if (quote == '`') {
+                // by hand, as only MySQL's mysql_real_escape_string_quote
+                // knows identifiers; the escape functions of MariaDB and
+                // older clients would put backslashes in
+                size_t start = out.size();
+                for (const char* p = in.data(), *end = p + in.size(); p != end;) {
+                    const char* q = (const char*)memchr(p, '`', end - p);
+                    if (!q) {
+                        out.append(p, end);
+                        break;
+                    }
+                    out.append(p, q + 1);
+                    out += '`';
+                    p = q + 1;
+                }
+                return out.size() - start;
+            }
+            if (!needs_escape(in.data(), in.size())) {
+                out.append(in.data(), in.size());
+                return in.size();
+            }
+            size_t start = out.size();
+            out.resize(start + 2 * in.size() + 1);
+            unsigned long n;
+            if (!handle) {
+                n = mysql_escape_string(&out[start], in.data(), in.size());
+            } else {
+#if !defined(MARIADB_PACKAGE_VERSION_ID) && MYSQL_VERSION_ID >= 50706
+                n = mysql_real_escape_string_quote(handle, &out[start], in.data(), in.size(), quote);
+#else
+                (void)quote;
+                n = mysql_real_escape_string(handle, &out[start], in.data(), in.size());
+#endif
+            }
+            out.resize(start + n);
+            return n;
+        }
+
+        Stmt   prepare(std::string s);
+        Result query(std::string s, ResultMode mode = ResultMode::streaming);
+
+        // Rows of the SELECT s, from the ResultCache if a fresh copy is there,
+        // otherwise run buffered and kept for ttl (the cache's default if
+        // zero). Other statements are run as by query() and not kept.
+        // nullptr on error or if s returns no rows.
+        std::shared_ptr<const RowSet> query_cached(std::string s,
+                                                   std::chrono::milliseconds ttl = std::chrono::milliseconds(0));
+
+        // Load rows into table (columns in the order given, or all of them
+        // if empty) with LOAD DATA LOCAL INFILE, streamed from memory as
+        // TSV without a temporary file. produce(out) adds rows with
+        // out.row(...) and returns whether it has more; the connection must
+        // have been opened with CLIENT_LOCAL_FILES and the server must allow
+        // local_infile. Returns the number of rows loaded, or -1.
+        template <class Produce>
+        typename std::enable_if<std::is_invocable_r<bool, Produce&, LoadWriter&>::value, long long>::type
+        bulk_load(const std::string& table, const std::vector<std::string>& columns, Produce produce);
+
+        // the same for a container of std::tuple rows, or of plain values
+        // for a single column, or a RowSet
+        template <class Container>
+        typename std::enable_if<!std::is_invocable_r<bool, Container&, LoadWriter&>::value, long long>::type
+        bulk_load(const std::string& table, const std::vector<std::string>& columns, const Container& rows);
+
+        // Send every statement of batch in one round trip and collect one
+        // BatchResult per statement, in order. Execution stops at the first
+        // failing statement; the ones after it are reported as not run.
+        // Multiple statements are enabled for the batch only, unless the
+        // connection was opened with CLIENT_MULTI_STATEMENTS.
+        std::vector<BatchResult> execute(const Batch& batch);
+
+        // Prepared statements kept in an LRU keyed by SQL text. The handle stays
+        // usable after eviction. connect() and close() empty the cache, and
+        // reconnect() fills it again; handles from before are stale().
+        std::shared_ptr<Stmt> prepare_cached(const std::string& s);
+
+        void set_stmt_cache_size(size_t n) {
+            Guard mg(*this);
+            stmt_cache_size = n;
+            trim_stmt_cache();
+        }
+        void clear_stmt_cache() {
+            Guard mg(*this);
+            drop_stmt_cache();
+        }
+        // Bind the connection to the calling thread: from then on its calls
+        // and those of its statements skip the mutex, and only that thread
+        // may use them, which is asserted in debug builds. For connections
+        // that one thread owns, such as ConnectionPool::local(); a pool
+        // unbinds connections returned to it.
+        void bind_to_thread() {
+            Guard mg(*this);
+            owner.bind();
+        }
+        // back to locking on every call; any thread may unbind
+        void unbind_thread() {
+            owner.unbind();
+        }
+        bool thread_affine() const {
+            return owner.bound();
+        }
+
+        inline
+        int insert_id() {
+            owner.check();
+            if(handle) {
+                return mysql_insert_id(handle);
+            }
+            return -1;
+        }
+        inline
+        int affected_rows() {
+            owner.check();
+            if (handle) {
+                return mysql_affected_rows(handle);
+            }
+            return -1;
+        }
+        // Start connecting without blocking; drive the returned operation
+        // with an EventLoop or by hand. Empty strings are passed as NULL.
+        AsyncConnect connect_async(
+                std::string host, std::string user, std::string password,
+                std::string db, unsigned int port, std::string unix_socket, unsigned long client_flag,
+                const ConnectOptions& options = ConnectOptions());
+
+        // Send s without blocking. The connection must not be used for
+        // anything else until the operation has finished. A lost connection
+        // is not reconnected here, as that blocks; call reconnect() first.
+        AsyncQuery query_async(std::string s, ResultMode mode = ResultMode::buffered);
+
+        // Read the next row of a streaming result of query_async() without
+        // blocking, under the same rule.
+        AsyncFetch fetch_async(Result& result);
+
+#if MYSQL_HPP_COROUTINES
+        // co_await forms of the async operations, driven by loop
+        Awaitable<AsyncConnect> connect(
+                EventLoop& loop, std::string host, std::string user, std::string password,
+                std::string db, unsigned int port, std::string unix_socket, unsigned long client_flag,
+                const ConnectOptions& options = ConnectOptions());
+        Awaitable<AsyncQuery> query(EventLoop& loop, std::string s, ResultMode mode = ResultMode::buffered);
+        Awaitable<AsyncPrepare> prepare(EventLoop& loop, std::string s);
+        // while (Row row = co_await rows.next()) ... over a streaming result
+        StreamAwaitable stream(EventLoop& loop, std::string s);
+#endif
+
+        // Report the cost of each connect, query, prepare and statement
+        // execute on this connection to observer, which must outlive it.
+        // Statements keep the observer they were prepared with. The async
+        // forms are not instrumented.
+        void set_observer(QueryObserver* observer) {
+            Guard mg(*this);
+            this->observer = observer;
+        }
+
+        // Serve query_cached() and Stmt::query_cached() from cache, which
+        // must outlive the connection and may be shared between
+        // connections. Writes through query(), execute() and statements
+        // prepared afterwards drop the entries of the tables they name.
+        // Entries are kept apart by the current database, as changed by a
+        // USE through query() or a Batch, and the set_session() variables.
+        void set_cache(ResultCache* cache) {
+            Guard mg(*this);
+            this->cache = cache;
+        }
+
+        // socket to watch for readiness of async operations, or -1
+        int socket() const {
+            return handle ? (int)mysql_get_socket(handle) : -1;
+        }
+
+        MYSQL* native_handle() const {
+            return handle;
+        }
+
+        inline
+        int more_results() {
+            return mysql_more_results(handle);
+        }
+
+        inline int next_result();
+        inline Result use_result();
+        inline Result store_result();
+    private:
+        friend class AsyncConnect;
+
+        typedef std::list<std::pair<std::string, std::shared_ptr<Stmt>>> stmt_list;
+
+        // what connect() was called with, for reconnect()
+        struct Target {
+            std::string host;
+            std::string user;
+            std::string password;
+            std::string db;
+            unsigned int port;
+            std::string unix_socket;
+            unsigned long client_flag;
+            ConnectOptions options;
+        };
+
+        MYSQL* handle;
+        mutable std::mutex mutex;
+        size_t stmt_cache_size;
+        bool multi_statements;
+        stmt_list stmt_lru;
+        std::unordered_map<std::string, stmt_list::iterator> stmt_index;
+        QueryObserver* observer;
+        std::shared_ptr<std::atomic<bool>> alive;
+        ResultCache* cache;
+        ThreadOwner owner;
+        std::unique_ptr<Target> target;
+        ReconnectOptions retry;
+        bool auto_reconnect;
+        // set during a reconnect(), which a lost connection met while
+        // restoring must not start again
+        bool reconnecting;
+        // SET SESSION assignments to replay, in order
+        std::vector<std::pair<std::string, std::string>> session;
+        // The current database and the session assignments as one string,
+        // which cache keys include: connections sharing a cache only
+        // share results of the same SQL run under both alike.
+        std::string database;
+        std::string session_scope;
+        // statements to prepare again once reconnected, most recent first
+        std::vector<std::string> unprepared;
+
+        // Holds mutex for its scope, unless the connection is bound to a
+        // thread, when it only checks that the caller is that thread.
+        class Guard {
+            private:
+                std::mutex* held;
+            public:
+                explicit Guard(const mysql& conn) : held(nullptr) {
+                    if (conn.owner.bound()) {
+                        conn.owner.check();
+                        return;
+                    }
+                    held = &conn.mutex;
+                    held->lock();
+                }
+                ~Guard() {
+                    if (held) held->unlock();
+                }
+
+                Guard(const Guard&) = delete;
+                Guard& operator=(const Guard&) = delete;
+        };
+
+        inline Stmt prepare_unlocked(const std::string& s, QueryTimer& timer);
+        inline Result run_query(std::string s, ResultMode mode);
+        inline void run_batch(const std::string& q, std::vector<BatchResult>& results, QueryTimer& timer);
+        inline long long load_data(const std::string& table, const std::vector<std::string>& columns,
+                                   std::function<bool(LoadWriter&)> produce);
+
+        void note_error(unsigned int err) {
+            if (connection_lost(err)) *alive = false;
+        }
+
+        static const char* c_str(const std::string& s) {
+            return s.empty() ? nullptr : s.c_str();
+        }
+
+        // caller holds mutex
+        bool is_open_unlocked() const {
+            return handle != nullptr && alive->load(std::memory_order_relaxed);
+        }
+
+        // caller holds mutex
+        void close_unlocked() {
+            // not to be reconnected by the next call
+            target.reset();
+            drop_stmt_cache();
+            *alive = false;
+            if (handle != nullptr) {
+                mysql_close(handle);
+                handle = nullptr;
+            }
+        }
+
+        // caller holds mutex; closes the connection and sets up a fresh
+        // nonblocking handle to connect to t with an AsyncConnect. Returns
+        // the client flags to connect with.
+        unsigned long start_connect(Target t) {
+            close_unlocked();
+            target.reset(new Target(std::move(t)));
+            alive = std::make_shared<std::atomic<bool>>(false);
+            handle = mysql_init(nullptr);
+#if MYSQL_HPP_ASYNC_MARIADB
+            if (handle) mysql_options(handle, MYSQL_OPT_NONBLOCK, 0);
+#endif
+            unsigned long client_flag = target->client_flag;
+            if (target->options.local_infile) client_flag |= CLIENT_LOCAL_FILES;
+            // a rejected option fails the connect
+            if (handle && !set_connect_options(handle, target->options, client_flag)) {
+                mysql_close(handle);
+                handle = nullptr;
+            }
+            return client_flag;
+        }
+
+        // caller holds mutex; connects handle to target afresh
+        bool connect_unlocked(QueryTimer& timer) {
+            *alive = false;
+            // statements prepared until now go stale
+            alive = std::make_shared<std::atomic<bool>>(false);
+            // also the unconnected handle from the constructor
+            if (handle) mysql_close(handle);
+            handle = mysql_init(nullptr);
+            if (handle == nullptr) return false;
+#if MYSQL_HPP_ASYNC_MARIADB
+            // lets the _start/_cont calls of query_async() run on this connection
+            mysql_options(handle, MYSQL_OPT_NONBLOCK, 0);
+#endif
+            const Target& t = *target;
+            unsigned long client_flag = t.client_flag;
+            if (t.options.local_infile) client_flag |= CLIENT_LOCAL_FILES;
+            if (!set_connect_options(handle, t.options, client_flag)) {
+                mysql_close(handle);
+                handle = nullptr;
+                timer.finish();
+                return false;
+            }
+            MYSQL* h = mysql_real_connect(handle, c_str(t.host), c_str(t.user), c_str(t.password),
+                                          c_str(t.db), t.port, c_str(t.unix_socket), client_flag);
+            timer.lap(timer.stats.server);
+            if (h) {
+                connected(client_flag);
+                timer.finish();
+                return true;
+            }
+            if (timer) timer.fail(mysql_errno(handle), mysql_error(handle));
+            else std::cerr << "Failed to connect to database: Error: " << mysql_error(handle) << "\n";
+            timer.finish();
+            mysql_close(handle);
+            handle = nullptr;
+            return false;
+        }
+
+        // caller holds mutex; handle has just connected to target with
+        // client_flag, by connect_unlocked() or an AsyncConnect
+        void connected(unsigned long client_flag) {
+            multi_statements = (client_flag & CLIENT_MULTI_STATEMENTS) != 0;
+            database = target->db;
+            // fails harmlessly on a unix socket
+            if (target->options.tcp_nodelay) {
+                int nodelay = *target->options.tcp_nodelay;
+                setsockopt(mysql_get_socket(handle), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            }
+            *alive = true;
+        }
+
+        // an AsyncConnect of h finished connecting, unless the connection
+        // was closed or connected again meanwhile
+        void async_connected(MYSQL* h, unsigned long client_flag) {
+            Guard mg(*this);
+            if (h == handle && target) connected(client_flag);
+        }
+
+        // caller holds mutex; after a USE ran, which may have failed or
+        // been one of several. Unless ask, or if asking fails, the database
+        // is one no other connection has, so nothing is shared.
+        void reread_database(bool ask) {
+            const char q[] = "SELECT DATABASE()";
+            if (ask && handle && mysql_real_query(handle, q, sizeof(q) - 1) == 0) {
+                if (MYSQL_RES* res = mysql_store_result(handle)) {
+                    MYSQL_ROW row = mysql_fetch_row(res);
+                    if (row) database = row[0] ? row[0] : "";
+                    mysql_free_result(res);
+                    if (row) return;
+                }
+            }
+            database = "\1" + std::to_string((uintptr_t)this);
+        }
+
+        // caller holds mutex, also while waiting between attempts, so no
+        // other call sees the connection before it is fully restored
+        bool reconnect_unlocked() {
+            if (!target || reconnecting) return false;
+            if (!stmt_lru.empty()) {
+                unprepared.clear();
+                for (const auto& e : stmt_lru) unprepared.push_back(e.first);
+                drop_stmt_cache();
+            }
+            // a connection lost again while restoring is left to the next call
+            reconnecting = true;
+            bool ok = restore_unlocked();
+            reconnecting = false;
+            return ok;
+        }
+
+        // caller holds mutex; reconnect_unlocked() past its checks
+        bool restore_unlocked() {
+            std::chrono::milliseconds delay = retry.initial_backoff;
+            for (unsigned int i = 1;; i++) {
+                QueryTimer timer(observer, QueryKind::connect, target->host);
+                if (connect_unlocked(timer)) break;
+                // calls on an unconnected handle fail instead of crashing
+                if (!handle) handle = mysql_init(nullptr);
+                if (i >= retry.attempts) return false;
+                std::this_thread::sleep_for(delay);
+                delay = std::min(delay * 2, retry.max_backoff);
+            }
+            if (!session.empty()) {
+                std::string q = "SET SESSION ";
+                for (const auto& v : session) {
+                    if (&v != &session.front()) q += ", ";
+                    q += v.first + " = " + v.second;
+                }
+                if (mysql_real_query(handle, q.c_str(), q.size()) != 0) {
+                    std::cerr << "Error: " << mysql_error(handle) << "\n";
+                    // not usable without its session: the next call
+                    // reconnects again, statements still unprepared
+                    *alive = false;
+                    return false;
+                }
+            }
+            // before any other call gets the connection, as statements and
+            // streaming results use it without the mutex
+            for (const std::string& s : unprepared) restore_stmt(s);
+            unprepared.clear();
+            return true;
+        }
+
+        // caller holds mutex
+        void revive() {
+            if (auto_reconnect && target && !alive->load(std::memory_order_relaxed)) reconnect_unlocked();
+        }
+
+        // caller holds mutex; puts s behind the statements already cached,
+        // unless someone prepared it meanwhile
+        inline void restore_stmt(const std::string& s);
+
+        // caller holds mutex
+        void trim_stmt_cache() {
+            while (stmt_lru.size() > stmt_cache_size) {
+                stmt_index.erase(stmt_lru.back().first);
+                stmt_lru.pop_back();
+            }
+        }
+        void drop_stmt_cache() {
+            stmt_index.clear();
+            stmt_lru.clear();
+        }
+};
+
+// BLOB parameter: the bytes are sent as binary rather than as text in the
+// connection character set. Does not own data.
+struct Blob {
+    const void* data;
+    unsigned long size;
+};
+
+// A parameter sent in pieces with mysql_stmt_send_long_data rather than
+// from one buffer, as an argument to Stmt::execute. next() returns each
+// chunk in turn and an empty view at the end; every chunk goes out as its
+// own packet, so none may exceed max_allowed_packet.
+template <class Next>
+struct LongData {
+    mutable Next next;
+    enum_field_types type;
+};
+
+template <class Next>
+LongData<Next> long_data(Next next, enum_field_types type = MYSQL_TYPE_BLOB) {
+    return LongData<Next>{std::move(next), type};
+}
+
+// chunk source for long_data() reading an istream
+class StreamChunks {
+    private:
+        std::istream* in;
+        std::vector<char> buf;
+    public:
+        StreamChunks(std::istream& in, size_t size = 256 * 1024) : in(&in), buf(size) {}
+
+        std::string_view operator()() {
+            if (!*in) return std::string_view();
+            in->read(buf.data(), buf.size());
+            return std::string_view(buf.data(), in->gcount());
+        }
+};
+
+// A result column passed to Stmt::fetch that is not copied out with the
+// row; read it afterwards in chunks with Stmt::stream_column.
+struct LongColumn {
+    size_t index;
+    unsigned long length;
+    bool null;
+
+    LongColumn() : index(0), length(0), null(true) {}
+};
+
+// How a C++ type is sent as a statement parameter: the protocol type, and
+// the slot a PreparedQuery keeps the value in between executions. set()
+// stores x and points b at the slot; b.is_null is already set up.
+template <class T, class = void>
+struct param_traits;
+
+template <class T>
+struct param_traits<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+    typedef T slot;
+    static constexpr enum_field_types type =
+        sizeof(T) == 1 ? MYSQL_TYPE_TINY : sizeof(T) == 2 ? MYSQL_TYPE_SHORT :
+        sizeof(T) == 4 ? MYSQL_TYPE_LONG : MYSQL_TYPE_LONGLONG;
+    static constexpr bool is_unsigned = std::is_unsigned<T>::value;
+    static void set(MYSQL_BIND& b, slot& s, const T& x) {
+        s = x;
+        b.buffer = &s;
+    }
+};
+
+template <>
+struct param_traits<float> {
+    typedef float slot;
+    static constexpr enum_field_types type = MYSQL_TYPE_FLOAT;
+    static constexpr bool is_unsigned = false;
+    static void set(MYSQL_BIND& b, slot& s, const float& x) {
+        s = x;
+        b.buffer = &s;
+    }
+};
+
+template <>
+struct param_traits<double> {
+    typedef double slot;
+    static constexpr enum_field_types type = MYSQL_TYPE_DOUBLE;
+    static constexpr bool is_unsigned = false;
+    static void set(MYSQL_BIND& b, slot& s, const double& x) {
+        s = x;
+        b.buffer = &s;
+    }
+};
+
+// string and blob values are copied; the buffer only moves, and forces a
+// rebind, when a longer value outgrows it
+struct bytes_slot {
+    std::string bytes;
+    unsigned long length;
+};
+
+inline
+void set_bytes(MYSQL_BIND& b, bytes_slot& s, const void* data, size_t size) {
+    s.bytes.assign((const char*)data, size);
+    s.length        = size;
+    b.buffer        = &s.bytes[0];
+    b.buffer_length = s.bytes.capacity();
+    b.length        = &s.length;
+}
+
+template <>
+struct param_traits<std::string> {
+    typedef bytes_slot slot;
+    static constexpr enum_field_types type = MYSQL_TYPE_STRING;
+    static constexpr bool is_unsigned = false;
+    static void set(MYSQL_BIND& b, slot& s, const std::string& x) {
+        set_bytes(b, s, x.data(), x.size());
+    }
+};
+
+template <>
+struct param_traits<std::string_view> {
+    typedef bytes_slot slot;
+    static constexpr enum_field_types type = MYSQL_TYPE_STRING;
+    static constexpr bool is_unsigned = false;
+    static void set(MYSQL_BIND& b, slot& s, const std::string_view& x) {
+        set_bytes(b, s, x.data(), x.size());
+    }
+};
+
+template <>
+struct param_traits<Blob> {
+    typedef bytes_slot slot;
+    static constexpr enum_field_types type = MYSQL_TYPE_BLOB;
+    static constexpr bool is_unsigned = false;
+    static void set(MYSQL_BIND& b, slot& s, const Blob& x) {
+        set_bytes(b, s, x.data, x.size);
+    }
+};
+
+template <>
+struct param_traits<MYSQL_TIME> {
+    typedef MYSQL_TIME slot;
+    static constexpr enum_field_types type = MYSQL_TYPE_DATETIME;
+    static constexpr bool is_unsigned = false;
+    static void set(MYSQL_BIND& b, slot& s, const MYSQL_TIME& x) {
+        s = x;
+        b.buffer        = &s;
+        b.buffer_length = sizeof(s);
+    }
+};
+
+// Broken down in UTC with microseconds. DATETIME values are taken as they
+// are, but TIMESTAMP columns read them in the session time_zone, so that
+// should be '+00:00'.
+template <>
+struct param_traits<std::chrono::system_clock::time_point> {
+    typedef MYSQL_TIME slot;
+    static constexpr enum_field_types type = MYSQL_TYPE_DATETIME;
+    static constexpr bool is_unsigned = false;
+    static void set(MYSQL_BIND& b, slot& s, const std::chrono::system_clock::time_point& x) {
+        long long us = std::chrono::duration_cast<std::chrono::microseconds>(x.time_since_epoch()).count();
+        long long frac = us % 1000000;
+        if (frac < 0) frac += 1000000;
+        time_t t = (us - frac) / 1000000;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        memset(&s, 0, sizeof(s));
+        s.year        = tm.tm_year + 1900;
+        s.month       = tm.tm_mon + 1;
+        s.day         = tm.tm_mday;
+        s.hour        = tm.tm_hour;
+        s.minute      = tm.tm_min;
+        s.second      = tm.tm_sec;
+        s.second_part = frac;
+        s.time_type   = MYSQL_TIMESTAMP_DATETIME;
+        b.buffer        = &s;
+        b.buffer_length = sizeof(s);
+    }
+};
+
+// empty optionals are sent as NULL
+template <class T>
+struct param_traits<std::optional<T>> {
+    typedef typename param_traits<T>::slot slot;
+    static constexpr enum_field_types type = param_traits<T>::type;
+    static constexpr bool is_unsigned = param_traits<T>::is_unsigned;
+    static void set(MYSQL_BIND& b, slot& s, const std::optional<T>& x) {
+        if (x) param_traits<T>::set(b, s, *x);
+        else *b.is_null = 1;
+    }
+};
+
+// Number of ? placeholders in sql, skipping quoted text and comments but
+// for the /*! ... */ and /*M! ... */ ones, which the server runs.
+constexpr size_t count_placeholders(const char* sql) {
+    size_t n = 0;
+    for (const char* p = sql; *p; p++) {
+        char c = *p;
+        if (c == '\'' || c == '"' || c == '`') {
+            for (p++; *p && *p != c; p++) {
+                if (*p == '\\' && c != '`' && p[1]) p++;
+            }
+            if (!*p) break;
+        } else if (c == '#' || (c == '-' && p[1] == '-' && (p[2] == ' ' || p[2] == '\t' || p[2] == '\n'))) {
+            while (p[1] && p[1] != '\n') p++;
+        } else if (c == '/' && p[1] == '*' && (p[2] == '!' || (p[2] == 'M' && p[3] == '!'))) {
+            // scanned on as SQL; neither the version number nor the */
+            // holds a placeholder
+            p += p[2] == '!' ? 2 : 3;
+        } else if (c == '/' && p[1] == '*') {
+            for (p += 2; *p && !(p[0] == '*' && p[1] == '/'); p++) {}
+            if (!*p) break;
+            p++;
+        } else if (c == '?') {
+            n++;
+        }
+    }
+    return n;
+}
+
+inline
+bool same_word(std::string_view a, const char* b) {
+    return a.size() == strlen(b) && strncasecmp(a.data(), b, a.size()) == 0;
+}
+
+// Call f(token, word) with each word of sql, backquotes removed, and each
+// other character that is not space, skipping comments. A string literal
+// is passed as a single "'".
+template <class F>
+void sql_tokens(std::string_view sql, F f) {
+    size_t n = sql.size();
+    auto in_word = [](unsigned char c) { return isalnum(c) || c == '_' || c == '$' || c >= 0x80; };
+    for (size_t i = 0; i < n;) {
+        unsigned char c = sql[i];
+        if (isspace(c)) {
+            i++;
+        } else if (c == '\'' || c == '"' || c == '`') {
+            size_t j = i + 1;
+            for (; j < n && sql[j] != (char)c; j++) {
+                if (sql[j] == '\\' && c != '`') j++;
+            }
+            j = std::min(j, n);
+            if (c == '`') f(sql.substr(i + 1, j - i - 1), true);
+            else f(std::string_view("'"), false);
+            i = j + 1;
+        } else if (c == '#' || (c == '-' && i + 2 < n && sql[i + 1] == '-' && isspace((unsigned char)sql[i + 2]))) {
+            while (i < n && sql[i] != '\n') i++;
+        } else if (c == '/' && i + 1 < n && sql[i + 1] == '*') {
+            size_t end = sql.find("*/", i + 2);
+            i = end == std::string_view::npos ? n : end + 2;
+        } else if (in_word(c)) {
+            size_t j = i + 1;
+            while (j < n && in_word(sql[j])) j++;
+            f(sql.substr(i, j - i), true);
+            i = j;
+        } else {
+            f(sql.substr(i, 1), false);
+            i++;
+        }
+    }
+}
+
+// Whether sql is a single SELECT that takes no locks and writes nothing,
+// so its result may be cached.
+inline
+bool is_read_only(std::string_view sql) {
+    bool first = true, select = false, writes = false, more = false, ended = false;
+    std::string_view prev;
+    sql_tokens(sql, [&](std::string_view t, bool) {
+        if (ended) {
+            more = true;
+            return;
+        }
+        if (first) select = same_word(t, "SELECT");
+        first = false;
+        // FOR UPDATE, FOR SHARE, LOCK IN SHARE MODE, and INTO a file or variable
+        if ((same_word(prev, "FOR") && (same_word(t, "UPDATE") || same_word(t, "SHARE")))
+            || (same_word(prev, "LOCK") && same_word(t, "IN")) || same_word(t, "INTO"))
+            writes = true;
+        if (t == ";") ended = true;
+        prev = t;
+    });
+    return select && !writes && !more;
+}
+
+// Whether one of the statements in sql is a USE, changing the database
+// unqualified table names resolve in.
+inline
+bool uses_database(std::string_view sql) {
+    bool start = true, found = false;
+    sql_tokens(sql, [&](std::string_view t, bool word) {
+        if (start && word && same_word(t, "USE")) found = true;
+        start = t == ";";
+    });
+    return found;
+}
+
+// Lowercased names of the tables sql reads or writes, without database
+// qualifiers. Errs on the side of extra names: an alias or column may be
+// reported as a table, but tables named in the statement are not missed.
+inline
+std::vector<std::string> tables_of(std::string_view sql) {
+    static const char* const before[] = {"FROM", "JOIN", "STRAIGHT_JOIN", "UPDATE", "INTO", "TABLE", "TRUNCATE",
+                                         "INSERT", "REPLACE", "TO"};
+    // words that may come between one of those and the table name
+    static const char* const modifiers[] = {"LOW_PRIORITY", "HIGH_PRIORITY", "DELAYED", "IGNORE", "QUICK", "INTO",
+                                            "TABLE", "IF", "NOT", "EXISTS", "TEMPORARY", "LATERAL"};
+    // words that start a list of tables separated by commas, and that end one
+    static const char* const lists[] = {"FROM", "JOIN", "STRAIGHT_JOIN", "UPDATE", "TABLE"};
+    static const char* const clauses[] = {"WHERE", "GROUP", "HAVING", "ORDER", "LIMIT", "WINDOW", "UNION", "EXCEPT",
+                                          "INTERSECT", "SET", "VALUES", "VALUE", "SELECT", "FOR", "LOCK", "INTO"};
+    auto among = [](std::string_view t, const char* const* words, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (same_word(t, words[i])) return true;
+        }
+        return false;
+    };
+    std::vector<std::string> tables;
+    std::string pending;
+    auto add = [&]() {
+        for (char& c : pending) c = tolower((unsigned char)c);
+        if (std::find(tables.begin(), tables.end(), pending) == tables.end()) tables.push_back(pending);
+    };
+    // table: expecting a table name; name: after one, which may be qualified;
+    // as: after AS; alias: after an alias
+    enum { none, table, name, dot, as, alias } state = none;
+    // parenthesis depth, and the depths of the table lists being read
+    int depth = 0;
+    std::vector<int> lists_open;
+    sql_tokens(sql, [&](std::string_view t, bool word) {
+        if (t == "(") {
+            depth++;
+        } else if (t == ")") {
+            depth--;
+            while (!lists_open.empty() && lists_open.back() > depth) lists_open.pop_back();
+        } else if (t == ";") {
+            lists_open.clear();
+        }
+        bool in_list = !lists_open.empty() && lists_open.back() == depth;
+        switch (state) {
+            case table:
+                if (word && among(t, modifiers, std::size(modifiers))) return;
+                state = none;
+                if (word && !among(t, before, std::size(before))) {
+                    pending.assign(t);
+                    state = name;
+                    return;
+                }
+                break;
+            case name:
+                if (t == ".") {
+                    state = dot;
+                    return;
+                }
+                add();
+                state = none;
+                if (word && same_word(t, "AS")) {
+                    state = as;
+                    return;
+                }
+                if (word && !among(t, before, std::size(before))) {
+                    state = alias;
+                    return;
+                }
+                break;
+            case dot:
+                state = none;
+                if (word) {
+                    pending.assign(t);
+                    state = name;
+                    return;
+                }
+                break;
+            case as:
+                state = none;
+                if (word) {
+                    state = alias;
+                    return;
+                }
+                break;
+            case alias:
+            case none:
+                state = none;
+                break;
+        }
+        // also after joins with ON conditions and index hints
+        if (t == "," && in_list) {
+            state = table;
+        } else if (word && among(t, before, std::size(before))) {
+            state = table;
+            if (!in_list && among(t, lists, std::size(lists))) lists_open.push_back(depth);
+        } else if (word && in_list && among(t, clauses, std::size(clauses))) {
+            lists_open.pop_back();
+        }
+    });
+    if (state == name || state == dot) add();
+    return tables;
+}
+
+class Stmt {
+    private:
+        // output buffer for one result column, reused across fetches
+        struct Column {
+            union {
+                int n;
+                unsigned int u;
+                long long ll;
+                unsigned long long ull;
+                float f;
+                double d;
+            } value;
+            std::vector<char> data;
+            unsigned long length;
+            my_bool null;
+            my_bool error;
+        };
+
+        // storage for one parameter: lengths of caller strings, or the value
+        // itself once bound with param<T>()
+        struct Param {
+            enum { none, value, bytes };
+            typename std::aligned_storage<sizeof(MYSQL_TIME), alignof(MYSQL_TIME)>::type fixed;
+            std::string data;
+            unsigned long length;
+            my_bool null;
+            // stays set: the null flag of an empty std::optional argument
+            my_bool absent;
+            char owner;
+
+            Param() : length(0), null(0), absent(1), owner(none) {}
+        };
+
+        // statements with at most this many placeholders keep their
+        // parameter binds inline instead of allocating them
+        static constexpr size_t inline_params = 4;
+
+        MYSQL_STMT* stmt;
+        size_t count;
+        // local_params, or an array of count on the heap
+        MYSQL_BIND* params;
+        MYSQL_BIND local_params[inline_params];
+        // On the heap even for few parameters: the references param<T>()
+        // returns and the binds pointing into the slots have to survive
+        // moving the statement.
+        std::vector<Param> slots;
+        bool params_bound;
+        std::vector<MYSQL_BIND> results;
+        std::vector<Column> columns;
+        bool results_bound;
+        MYSQL* conn;
+        std::string sql;
+        // multi-row rewrites of sql used by execute_batch, the one at k for
+        // 2^k rows, prepared on first use
+        std::vector<std::unique_ptr<Stmt>> batch_stmts;
+        unsigned long max_packet;
+        QueryObserver* observer;
+        // liveness flag of the connection as it was when prepared, cleared
+        // when it is lost; every connect starts a new one
+        std::shared_ptr<std::atomic<bool>> alive;
+        // thread the connection is bound to, checked in debug builds; part of
+        // the connection, so only to be looked at while not stale()
+        const ThreadOwner* owner;
+        // results of query_cached, and the tables a write invalidates in it
+        ResultCache* cache;
+        std::vector<std::string> tables;
+        bool writes;
+        // of the cache keys: the database when prepared, which the
+        // statement's tables resolved in, and the connection's session
+        // assignments, only to be looked at while not stale()
+        std::string database;
+        const std::string* session;
+    public:
+        Stmt() : stmt(0), count(0), params(0), params_bound(false), results_bound(false), conn(nullptr),
+                 max_packet(0), observer(nullptr), alive(nullptr), owner(nullptr), cache(nullptr), writes(false),
+                 session(nullptr) {}
+        Stmt(MYSQL_STMT* stmt)
+            : stmt(stmt), count(mysql_stmt_param_count(stmt)), params(nullptr), slots(count),
+              params_bound(false), results_bound(false), conn(nullptr), max_packet(0), observer(nullptr),
+              alive(nullptr), owner(nullptr), cache(nullptr), writes(false), session(nullptr) {
+            alloc_params();
+        }
+        Stmt(MYSQL* conn, MYSQL_STMT* stmt, std::string sql, QueryObserver* observer = nullptr,
+             std::shared_ptr<std::atomic<bool>> alive = nullptr, ResultCache* cache = nullptr,
+             const ThreadOwner* owner = nullptr, std::string database = std::string(),
+             const std::string* session = nullptr)
+            : stmt(stmt), count(mysql_stmt_param_count(stmt)), params(nullptr), slots(count),
+              params_bound(false), results_bound(false), conn(conn), sql(std::move(sql)), max_packet(0),
+              observer(observer), alive(std::move(alive)), owner(owner), cache(cache), writes(false),
+              database(std::move(database)), session(session) {
+            alloc_params();
+            if (cache) {
+                tables = tables_of(this->sql);
+                writes = !is_read_only(this->sql);
+            }
+        }
+
+        ~Stmt() {
+            if (stmt) mysql_stmt_close(stmt);
+            free_params();
+        }
+
+        Stmt(const Stmt&) = delete;
+        Stmt& operator=(const Stmt&) = delete;
+
+        // The values parameters were bound to stay where they are, in the
+        // slots or the caller's variables, so a moved statement executes
+        // without binding them again unless they were inline.
+        Stmt(Stmt&& x) noexcept
+            : stmt(x.stmt), count(x.count), params(nullptr),
+              slots(std::move(x.slots)), params_bound(x.params_bound), results(std::move(x.results)), columns(std::move(x.columns)), results_bound(x.results_bound),
+              conn(x.conn), sql(std::move(x.sql)), batch_stmts(std::move(x.batch_stmts)),
+              max_packet(x.max_packet), observer(x.observer), alive(std::move(x.alive)), owner(x.owner), cache(x.cache),
+              tables(std::move(x.tables)), writes(x.writes), database(std::move(x.database)), session(x.session) {
+            take_params(x);
+            x.stmt = 0;
+        }
+
+        Stmt& operator=(Stmt&& x) noexcept {
+            if (this == &x) return *this;
+            if (stmt) mysql_stmt_close(stmt);
+            free_params();
+            stmt   = x.stmt;
+            count  = x.count;
+            params_bound = x.params_bound;
+            take_params(x);
+            slots    = std::move(x.slots);
+            results  = std::move(x.results);
+            columns  = std::move(x.columns);
+            results_bound = x.results_bound;
+            conn     = x.conn;
+            sql      = std::move(x.sql);
+            batch_stmts = std::move(x.batch_stmts);
+            max_packet = x.max_packet;
+            observer = x.observer;
+            alive    = std::move(x.alive);
+            owner    = x.owner;
+            cache    = x.cache;
+            tables   = std::move(x.tables);
+            writes   = x.writes;
+            database = std::move(x.database);
+            session  = x.session;
+            x.stmt   = 0;
+            return *this;
+        }
+
+        operator bool() {
+            return !!stmt;
+        }
+
+        // Whether the connection this was prepared on is gone, closed or
+        // replaced by a reconnect; execute() then fails without a round
+        // trip and the statement has to be prepared again.
+        bool stale() const {
+            return alive && !alive->load(std::memory_order_relaxed);
+        }
+
+
+        // The statement is only rebound by the next execute when something
+        // the client library copied at bind time changes: the type, or where
+        // the value, its length or its null flag live.
+        void bind_param(int i, enum_field_types buffer_type, void* buffer, int buffer_length, my_bool* is_null,
+                        long unsigned int* length, bool is_unsigned = false) {
+            MYSQL_BIND& b   = params[i];
+            if (b.buffer_type != buffer_type || b.buffer != buffer || b.is_null != is_null || b.length != length
+                || !!b.is_unsigned != is_unsigned || (!length && b.buffer_length != (unsigned long)buffer_length))
+                params_bound = false;
+            b.buffer_type   = buffer_type;
+            b.buffer        = (char*)buffer;
+            b.buffer_length = buffer_length;
+            b.is_null       = is_null;
+            b.length        = length;
+            b.is_unsigned   = is_unsigned;
+            slots[i].owner  = Param::none;
+        }
+
+        template <class T>
+        inline
+        typename std::enable_if<std::is_integral<T>::value>::type bind_param(int i, const T& x) {
+            bind_param(i, param_traits<T>::type, (char*)&x, 0, 0, 0, param_traits<T>::is_unsigned);
+        }
+
+        inline
+        void bind_param(int i, const float& x) {
+            bind_param(i, MYSQL_TYPE_FLOAT, (char*)&x, 0, 0, 0);
+        }
+
+        inline
+        void bind_param(int i, const double& x) {
+            bind_param(i, MYSQL_TYPE_DOUBLE, (char*)&x, 0, 0, 0);
+        }
+
+        inline
+        void bind_param(int i, const std::string& x) {
+            bind_bytes(i, MYSQL_TYPE_STRING, x.c_str(), x.size());
+        }
+
+        inline
+        void bind_param(int i, const std::string_view& x) {
+            bind_bytes(i, MYSQL_TYPE_STRING, x.data(), x.size());
+        }
+
+        inline
+        void bind_param(int i, const char* x) {
+            bind_param(i, std::string_view(x));
+        }
+
+        inline
+        void bind_param(int i, const Blob& x) {
+            bind_bytes(i, MYSQL_TYPE_BLOB, x.data, x.size);
+        }
+
+        inline
+        void bind_param(int i, const MYSQL_TIME& x) {
+            bind_param(i, MYSQL_TYPE_DATETIME, (char*)&x, sizeof(x), 0, 0);
+        }
+
+        template <class T>
+        inline
+        void bind_param(int i, const std::optional<T>& x) {
+            if (x) bind_param(i, *x);
+            else bind_param(i, param_traits<T>::type, nullptr, 0, &slots[i].absent, 0);
+        }
+
+        // Bind parameter i to a value owned by the Stmt and return it, so a
+        // loop can assign it before each execute() without rebinding:
+        //
+        //     long long& id = stmt.param<long long>(0);
+        //     std::string& name = stmt.param<std::string>(1);
+        //     for (...) { id = ...; name = ...; stmt.execute(); }
+        //
+        // The reference stays valid until param i is bound to something
+        // else, also when the statement is moved.
+        template <class T>
+        typename std::enable_if<std::is_arithmetic<T>::value || std::is_same<T, MYSQL_TIME>::value, T&>::type
+        param(size_t i) {
+            Param& p = slots[i];
+            T* x = reinterpret_cast<T*>(&p.fixed);
+            if (p.owner != Param::value || params[i].buffer_type != param_traits<T>::type
+                || !!params[i].is_unsigned != param_traits<T>::is_unsigned)
+                x = new (&p.fixed) T();
+            bind_param(i, param_traits<T>::type, x, sizeof(T), &p.null, 0, param_traits<T>::is_unsigned);
+            p.owner = Param::value;
+            return *x;
+        }
+
+        template <class T>
+        typename std::enable_if<std::is_same<T, std::string>::value, T&>::type
+        param(size_t i) {
+            Param& p = slots[i];
+            p.length = p.data.size();
+            bind_param(i, MYSQL_TYPE_STRING, &p.data[0], p.data.size(), &p.null, &p.length);
+            p.owner = Param::bytes;
+            return p.data;
+        }
+
+        // Send parameter i of the next execute() from next() chunk by chunk,
+        // see LongData. Bind the other parameters first: binding again
+        // after this drops the data sent.
+        template <class Next>
+        bool stream_param(size_t i, Next next, enum_field_types type = MYSQL_TYPE_BLOB) {
+            bind_bytes(i, type, nullptr, 0);
+            if (!bind_params()) {
+                std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+                return false;
+            }
+            return send_chunks(i, next);
+        }
+
+        template <class Next>
+        inline
+        void bind_param(int i, const LongData<Next>& x) {
+            bind_bytes(i, x.type, nullptr, 0);
+        }
+
+        // NULL flag of a parameter bound with param<T>()
+        void set_null(size_t i, bool null = true) {
+            slots[i].null = null;
+        }
+
+        // With no arguments, runs with the parameters bound last; otherwise
+        // there must be one argument per placeholder.
+        template <class... Types>
+        inline
+        bool execute(const Types& ... args) {
+            if (!can_execute(sizeof...(Types))) return false;
+            QueryTimer timer(observer, QueryKind::execute, sql);
+            _execute(0, args...);
+            bool ok = bind_params() && _send_long(0, args...);
+            return run_execute(timer, ok, params);
+        }
+
+        // Rows of the statement run with args, from the connection's
+        // ResultCache when a fresh copy is there. Keyed by the SQL and the
+        // argument values; see mysql::query_cached. nullptr on error.
+        template <class... Types>
+        std::shared_ptr<const RowSet> query_cached(const Types& ... args);
+
+        // Copy the remaining rows into a RowSet, every column as text.
+        RowSet fetch_all();
+
+        template <class T, class... Types>
+        inline
+        void _execute(int n, const T& x, const Types& ... args) {
+            bind_param(n, x);
+            _execute(n+1, args...);
+        }
+
+        // base case
+        inline
+        void _execute(int n) {}
+
+#if MYSQL_HPP_COROUTINES
+        // co_await stmt.execute(loop, args...)
+        template <class... Types>
+        Awaitable<AsyncExecute> execute(EventLoop& loop, const Types& ... args);
+#endif
+
+        // bind args without executing, e.g. ahead of an AsyncExecute
+        template <class... Types>
+        bool bind(const Types& ... args) {
+            _execute(0, args...);
+            return bind_params();
+        }
+
+        MYSQL_STMT* native_handle() const {
+            return stmt;
+        }
+
+        // Execute once per element of rows, each a std::tuple of parameters (or
+        // a plain value for single-parameter statements). The rows are sent in
+        // chunks sized to the server's max_allowed_packet: as one array-bound
+        // execute with MariaDB Connector/C, otherwise by rewriting
+        // INSERT ... VALUES (...) into a multi-row VALUES statement. Other
+        // statements fall back to one execute per row. Returns the total of
+        // affected rows, or -1 on the first failure.
+        template <class Container>
+        long long execute_batch(const Container& rows) {
+            if (!stmt) return -1;
+            if (stale()) {
+                std::cerr << "Error: statement outlived its connection\n";
+                return -1;
+            }
+            if (owner) owner->check();
+            if (rows.begin() == rows.end()) return 0;
+            if (count == 0 || !conn) return execute_rows(rows.begin(), rows.end());
+
+            if (max_packet == 0) max_packet = server_max_packet(conn);
+            // leave room for the packet header and statement id
+            size_t budget = std::min<unsigned long>(max_packet, 16UL << 20) - 1024;
+
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+            long long total = execute_bulk(rows.begin(), rows.end(), budget);
+            if (total != -2) return total;
+#endif
+            size_t open, close;
+            if (!find_values(open, close)) return execute_rows(rows.begin(), rows.end());
+            return execute_rewritten(rows.begin(), rows.end(), budget, open, close);
+        }
+
+        template <class... Types>
+        static const std::tuple<Types...>& batch_row(const std::tuple<Types...>& row) {
+            return row;
+        }
+
+        template <class T>
+        static std::tuple<const T&> batch_row(const T& x) {
+            return std::tuple<const T&>(x);
+        }
+
+        template <class Tuple>
+        inline
+        void bind_row(int n, const Tuple& row) {
+            std::apply([this, n](const auto& ... args) { _execute(n, args...); }, row);
+        }
+
+        // Buffer the whole result set client-side so the connection can be
+        // used for other statements while the rows are fetched.
+        inline
+        bool store_result() {
+            return mysql_stmt_store_result(stmt) == 0;
+        }
+
+        // Have each execute() until close_cursor() open a read-only cursor on
+        // the server, so fetch() pulls prefetch rows per round trip instead
+        // of the whole result set. Client memory stays bounded by one chunk;
+        // don't store_result() a cursor.
+        bool open_cursor(unsigned long prefetch = 1024) {
+            if (!stmt) return false;
+            if (stale()) {
+                std::cerr << "Error: statement outlived its connection\n";
+                return false;
+            }
+            if (owner) owner->check();
+            unsigned long type = CURSOR_TYPE_READ_ONLY;
+            prefetch = std::max(prefetch, 1UL);
+            if (mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &type)
+                || mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch)) {
+                note_error();
+                std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+                return false;
+            }
+            return true;
+        }
+
+        // Close the open cursor, if any, and execute without one again.
+        bool close_cursor() {
+            if (!stmt) return false;
+            if (stale()) {
+                std::cerr << "Error: statement outlived its connection\n";
+                return false;
+            }
+            if (owner) owner->check();
+            unsigned long type = CURSOR_TYPE_NO_CURSOR;
+            bool ok = mysql_stmt_free_result(stmt) == 0;
+            ok = mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &type) == 0 && ok;
+            if (!ok) {
+                note_error();
+                std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+            }
+            return ok;
+        }
+
+        // Fetch the next row of the result set into out... using the binary
+        // protocol. Output buffers are kept between calls and rebound only
+        // when the requested types change or a value outgrows its buffer.
+        // Returns false at the end of the result set or on error.
+        template <class... Types>
+        bool fetch(Types& ... out) {
+            if (!stmt) return false;
+            if (stale()) {
+                std::cerr << "Error: statement outlived its connection\n";
+                return false;
+            }
+            if (owner) owner->check();
+            if (!prepare_results(sizeof...(Types))) return false;
+            _bind_result(0, out...);
+            if (!results_bound) {
+                if (mysql_stmt_bind_result(stmt, results.data())) {
+                    std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+                    return false;
+                }
+                results_bound = true;
+            }
+            int x = mysql_stmt_fetch(stmt);
+            if (x == MYSQL_NO_DATA) return false;
+            if (x == 1 || (x == MYSQL_DATA_TRUNCATED && !fetch_truncated())) {
+                note_error();
+                std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+                return false;
+            }
+            _fetch(0, out...);
+            return true;
+        }
+
+        template <class... Types>
+        bool fetch(std::tuple<Types...>& row) {
+            return fetch_tuple(row, std::index_sequence_for<Types...>{});
+        }
+
+        // for (auto& [id, name] : stmt.rows<int, std::string>()) ...
+        template <class... Types>
+        StmtRows<Types...> rows();
+
+        // Pass the bytes of column c of the row just fetched to write, at
+        // most chunk at a time, without holding the whole value in memory.
+        template <class Write>
+        bool stream_column(const LongColumn& c, Write write, size_t chunk = 64 * 1024) {
+            if (!stmt) return false;
+            if (stale()) {
+                std::cerr << "Error: statement outlived its connection\n";
+                return false;
+            }
+            if (owner) owner->check();
+            if (c.null || c.length == 0) return true;
+            std::vector<char> buf(std::min<size_t>(chunk, c.length));
+            unsigned long length = 0;
+            MYSQL_BIND b;
+            memset(&b, 0, sizeof(MYSQL_BIND));
+            b.buffer_type   = MYSQL_TYPE_BLOB;
+            b.buffer        = buf.data();
+            b.buffer_length = buf.size();
+            b.length        = &length;
+            for (unsigned long offset = 0; offset < c.length; offset += b.buffer_length) {
+                if (mysql_stmt_fetch_column(stmt, &b, c.index, offset)) {
+                    note_error();
+                    std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+                    return false;
+                }
+                write(std::string_view(buf.data(), std::min<unsigned long>(b.buffer_length, c.length - offset)));
+            }
+            return true;
+        }
+
+        // whether column n of the last fetched row was NULL
+        bool is_null(size_t n) const {
+            return n < columns.size() && columns[n].null;
+        }
+
+    private:
+        template <const char* SQL, class Sig> friend class PreparedQuery;
+        friend class AsyncExecute;
+
+        void note_error() {
+            if (alive && connection_lost(mysql_stmt_errno(stmt))) *alive = false;
+        }
+
+        // the checks before an execute with given arguments
+        bool can_execute(size_t given) {
+            if (given != 0 && given != count) {
+                std::cerr << "Error: statement takes " << count << " parameters, "
+                          << given << " given\n";
+                return false;
+            }
+            if (stale()) {
+                std::cerr << "Error: statement outlived its connection\n";
+                return false;
+            }
+            if (owner) owner->check();
+            return true;
+        }
+
+        // The execute itself, once the parameters were sent if ok, and its
+        // accounting.
+        bool run_execute(QueryTimer& timer, bool ok, const MYSQL_BIND* sent) {
+            timer.lap(timer.stats.send);
+            if (ok) {
+                ok = mysql_stmt_execute(stmt) == 0;
+                timer.lap(timer.stats.server);
+            }
+            return account_execute(timer, ok, sent);
+        }
+
+        // after an execute, here, in execute_bulk() or in an AsyncExecute:
+        // errors, the observer and the cache. Without sent binds the caller
+        // has set stats.bytes_sent.
+        bool account_execute(QueryTimer& timer, bool ok, const MYSQL_BIND* sent) {
+            if (!ok) {
+                note_error();
+                timer.fail(mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+                timer.finish();
+                return false;
+            }
+            if (timer) {
+                if (sent) timer.stats.bytes_sent = bound_size(sent, count);
+                if (mysql_stmt_field_count(stmt) == 0) timer.stats.rows = mysql_stmt_affected_rows(stmt);
+                timer.finish();
+            }
+            if (writes) invalidate_cache();
+            return true;
+        }
+
+        // execute() with binds the caller keeps, bound first if rebind
+        bool execute_binds(MYSQL_BIND* binds, bool rebind) {
+            if (!stmt) return false;
+            if (stale()) {
+                std::cerr << "Error: statement outlived its connection\n";
+                return false;
+            }
+            if (owner) owner->check();
+            QueryTimer timer(observer, QueryKind::execute, sql);
+            bool ok = true;
+            if (rebind) {
+                ok = mysql_stmt_bind_param(stmt, binds) == 0;
+                // the library no longer has our own params
+                params_bound = false;
+            }
+            return run_execute(timer, ok, binds);
+        }
+
+        void alloc_params() {
+            params = count <= inline_params ? local_params : new MYSQL_BIND[count];
+            memset(params, 0, count * sizeof(MYSQL_BIND));
+        }
+        void free_params() {
+            if (params != local_params) delete [] params;
+            params = nullptr;
+        }
+        // caller has set count and params_bound from x; leaves x without
+        // parameters. Inline binds are copied, and the copy has to be bound
+        // before the next execute.
+        void take_params(Stmt& x) {
+            if (x.params == x.local_params) {
+                memcpy(local_params, x.local_params, count * sizeof(MYSQL_BIND));
+                params = local_params;
+                params_bound = false;
+            } else {
+                params = x.params;
+            }
+            x.params = nullptr;
+            x.count  = 0;
+        }
+
+        inline void invalidate_cache();
+
+        // strings and blobs get their length from the slot, so a new value at
+        // the same address needs no rebind
+        void bind_bytes(int i, enum_field_types type, const void* data, size_t size) {
+            slots[i].length = size;
+            bind_param(i, type, (void*)data, size, 0, &slots[i].length);
+        }
+
+        template <class T, class... Types>
+        bool _send_long(int n, const T& x, const Types& ... args) {
+            return send_long(n, x) && _send_long(n+1, args...);
+        }
+
+        bool _send_long(int) {
+            return true;
+        }
+
+        template <class T>
+        bool send_long(int, const T&) {
+            return true;
+        }
+
+        template <class Next>
+        bool send_long(int n, const LongData<Next>& x) {
+            return send_chunks(n, x.next);
+        }
+
+        template <class Next>
+        bool send_chunks(int n, Next& next) {
+            for (std::string_view chunk = next(); !chunk.empty(); chunk = next()) {
+                if (mysql_stmt_send_long_data(stmt, n, chunk.data(), chunk.size())) {
+                    note_error();
+                    std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool bind_params() {
+            for (size_t i = 0; i < count; i++) {
+                Param& p = slots[i];
+                if (p.owner != Param::bytes) continue;
+                p.length = p.data.size();
+                bind_param(i, params[i].buffer_type, &p.data[0], p.data.size(), &p.null, &p.length);
+                p.owner = Param::bytes;
+            }
+            if (params_bound) return true;
+            if (mysql_stmt_bind_param(stmt, params)) return false;
+            params_bound = true;
+            return true;
+        }
+
+        template <class It>
+        long long execute_rows(It first, It last) {
+            long long total = 0;
+            for (; first != last; ++first) {
+                bind_row(0, batch_row(*first));
+                if (!execute()) return -1;
+                total += mysql_stmt_affected_rows(stmt);
+            }
+            return total;
+        }
+
+        // Locate the parenthesised row after VALUES so it can be repeated;
+        // placeholders outside of it mean the statement can't be rewritten.
+        bool find_values(size_t& open, size_t& close) const {
+            char quote = 0;
+            open = std::string::npos;
+            size_t depth = 0;
+            size_t inside = 0;
+            for (size_t i = 0; i < sql.size(); i++) {
+                char c = sql[i];
+                if (quote) {
+                    if (c == '\\' && quote != '`') i++;
+                    else if (c == quote) quote = 0;
+                } else if (c == '\'' || c == '"' || c == '`') {
+                    quote = c;
+                } else if (open == std::string::npos) {
+                    if (c == '?') return false;
+                    if ((c == 'V' || c == 'v') && (i == 0 || !isalnum((unsigned char)sql[i - 1]))
+                        && strncasecmp(sql.c_str() + i, "VALUES", 6) == 0) {
+                        size_t j = i + 6;
+                        while (j < sql.size() && isspace((unsigned char)sql[j])) j++;
+                        if (j < sql.size() && sql[j] == '(') {
+                            open  = j;
+                            depth = 1;
+                            i     = j;
+                        }
+                    }
+                } else if (depth > 0) {
+                    if (c == '(') depth++;
+                    else if (c == ')' && --depth == 0) close = i;
+                    else if (c == '?') inside++;
+                } else if (c == '?') {
+                    return false;
+                }
+            }
+            return open != std::string::npos && depth == 0 && inside == count;
+        }
+
+        std::unique_ptr<Stmt> prepare_rows(size_t n, size_t open, size_t close) const {
+            std::string q = sql.substr(0, close + 1);
+            std::string row = sql.substr(open, close + 1 - open);
+            q.reserve(sql.size() + (row.size() + 2) * n);
+            for (size_t i = 1; i < n; i++) {
+                q += ", ";
+                q += row;
+            }
+            q.append(sql, close + 1, std::string::npos);
+            MYSQL_STMT* s = mysql_stmt_init(conn);
+            if (!s) return nullptr;
+            if (mysql_stmt_prepare(s, q.c_str(), q.size())) {
+                std::cerr << "Error: " << mysql_stmt_error(s) << "\n";
+                mysql_stmt_close(s);
+                return nullptr;
+            }
+            return std::unique_ptr<Stmt>(new Stmt(conn, s, q, observer, alive, cache, owner));
+        }
+
+        // The rewrite of sql for n rows, n a power of two, so that however
+        // the rows run no more than a few statements are prepared and kept.
+        Stmt* rows_stmt(size_t n, size_t open, size_t close) {
+            size_t k = __builtin_ctzll(n);
+            if (batch_stmts.size() <= k) batch_stmts.resize(k + 1);
+            if (!batch_stmts[k]) batch_stmts[k] = prepare_rows(n, open, close);
+            return batch_stmts[k].get();
+        }
+
+        // Each chunk starts at the largest power of two of rows that fits if
+        // all were as wide as its first, and halves while its bound rows
+        // outgrow budget bytes, binding them again, so no pass over rows
+        // precedes the sending. A chunk of one row is a plain execute.
+        template <class It>
+        long long execute_rewritten(It first, It last, size_t budget, size_t open, size_t close) {
+            auto floor_pow2 = [](size_t n) { return size_t(1) << (63 - __builtin_clzll(n)); };
+            long long total = 0;
+            while (first != last) {
+                bind_row(0, batch_row(*first));
+                // placeholders per statement are capped at 65535 by the protocol
+                size_t fit = std::min(65535 / count, std::max<size_t>(1, budget / bound_size(params, count)));
+                size_t n = 0;
+                for (It it = first; it != last && n < fit; ++it) n++;
+                n = floor_pow2(n);
+                while (n > 1) {
+                    Stmt* target = rows_stmt(n, open, close);
+                    if (!target) return -1;
+                    It it = first;
+                    size_t r = 0, bytes = 0;
+                    for (; r < n; ++r, ++it) {
+                        target->bind_row(r * count, batch_row(*it));
+                        bytes += bound_size(target->params + r * count, count);
+                        // a single row too large is left to the server to refuse
+                        if (r && bytes > budget) break;
+                    }
+                    if (r < n) {
+                        n = floor_pow2(r);
+                        continue;
+                    }
+                    if (!target->execute()) return -1;
+                    total += mysql_stmt_affected_rows(target->stmt);
+                    first = it;
+                    break;
+                }
+                if (n == 1) {
+                    It next = std::next(first);
+                    long long one = execute_rows(first, next);
+                    if (one < 0) return -1;
+                    total += one;
+                    first = next;
+                }
+            }
+            return total;
+        }
+
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+        // parameters of one column, laid out for column-wise array binding
+        struct BulkColumn {
+            std::vector<char> fixed;
+            std::vector<const char*> ptrs;
+            std::vector<unsigned long> lengths;
+            std::vector<char> indicators;
+        };
+
+        // Returns -2 if the server doesn't take array binds before anything was
+        // sent, so the caller can use another strategy.
+        template <class It>
+        long long execute_bulk(It first, It last, size_t budget) {
+            long long total = 0;
+            bool sent = false;
+            std::vector<BulkColumn> cols(count);
+            std::vector<MYSQL_BIND> binds(count);
+            while (first != last) {
+                for (BulkColumn& c : cols) {
+                    c.fixed.clear();
+                    c.ptrs.clear();
+                    c.lengths.clear();
+                    c.indicators.clear();
+                }
+                unsigned int n = 0;
+                size_t bytes = 0;
+                QueryTimer timer(observer, QueryKind::execute, sql);
+                // rows are added while they fit in budget bytes; the one that
+                // doesn't starts the next chunk and is bound again there
+                for (; first != last; ++first, ++n) {
+                    bind_row(0, batch_row(*first));
+                    size_t size = bound_size(params, count);
+                    if (n && bytes + size > budget) break;
+                    bytes += size;
+                    for (size_t i = 0; i < count; i++) {
+                        const MYSQL_BIND& b = params[i];
+                        BulkColumn& c = cols[i];
+                        size_t width = fixed_size(b.buffer_type);
+                        bool null = b.is_null && *b.is_null;
+                        c.indicators.push_back(null ? STMT_INDICATOR_NULL : STMT_INDICATOR_NONE);
+                        if (width) {
+                            const char* p = (const char*)b.buffer;
+                            if (null) c.fixed.resize(c.fixed.size() + width);
+                            else c.fixed.insert(c.fixed.end(), p, p + width);
+                        } else {
+                            c.ptrs.push_back((const char*)b.buffer);
+                            c.lengths.push_back(b.length ? *b.length : b.buffer_length);
+                        }
+                    }
+                }
+                for (size_t i = 0; i < count; i++) {
+                    MYSQL_BIND& b = binds[i];
+                    BulkColumn& c = cols[i];
+                    memset(&b, 0, sizeof(MYSQL_BIND));
+                    b.buffer_type = params[i].buffer_type;
+                    b.is_unsigned = params[i].is_unsigned;
+                    b.u.indicator = c.indicators.data();
+                    if (fixed_size(b.buffer_type)) {
+                        b.buffer = c.fixed.data();
+                    } else {
+                        b.buffer = c.ptrs.data();
+                        b.length = c.lengths.data();
+                    }
+                }
+                bool ok = !mysql_stmt_attr_set(stmt, STMT_ATTR_ARRAY_SIZE, &n)
+                       && !mysql_stmt_bind_param(stmt, binds.data());
+                timer.lap(timer.stats.send);
+                if (ok) {
+                    ok = mysql_stmt_execute(stmt) == 0;
+                    timer.lap(timer.stats.server);
+                }
+                unsigned int none = 0;
+                mysql_stmt_attr_set(stmt, STMT_ATTR_ARRAY_SIZE, &none);
+                // the array binds replaced ours
+                params_bound = false;
+                if (!ok) {
+                    unsigned int err = mysql_stmt_errno(stmt);
+                    // unreported: the caller falls back to another strategy
+                    if (!sent && err >= 2000 && err < 3000 && !connection_lost(err)) return -2;
+                }
+                timer.stats.bytes_sent = bytes;
+                if (!account_execute(timer, ok, nullptr)) return -1;
+                sent = true;
+                total += mysql_stmt_affected_rows(stmt);
+            }
+            return total;
+        }
+#endif
+
+        static size_t fixed_size(enum_field_types type) {
+            switch (type) {
+                case MYSQL_TYPE_TINY:     return 1;
+                case MYSQL_TYPE_SHORT:    return 2;
+                case MYSQL_TYPE_LONG:     return 4;
+                case MYSQL_TYPE_FLOAT:    return 4;
+                case MYSQL_TYPE_LONGLONG: return 8;
+                case MYSQL_TYPE_DOUBLE:   return 8;
+                case MYSQL_TYPE_DATE: case MYSQL_TYPE_TIME:
+                case MYSQL_TYPE_DATETIME: case MYSQL_TYPE_TIMESTAMP:
+                    return sizeof(MYSQL_TIME);
+                default: return 0;
+            }
+        }
+
+        // approximate bytes a row of bound parameters takes on the wire
+        static size_t bound_size(const MYSQL_BIND* binds, size_t n) {
+            size_t size = 0;
+            for (size_t i = 0; i < n; i++) {
+                size_t width = fixed_size(binds[i].buffer_type);
+                size += width ? width : 9 + (binds[i].length ? *binds[i].length : binds[i].buffer_length);
+            }
+            return size;
+        }
+
+        static unsigned long server_max_packet(MYSQL* conn) {
+            unsigned long size = 0;
+            const char q[] = "SELECT @@max_allowed_packet";
+            if (mysql_real_query(conn, q, sizeof(q) - 1) == 0) {
+                if (MYSQL_RES* res = mysql_store_result(conn)) {
+                    MYSQL_ROW row = mysql_fetch_row(res);
+                    if (row && row[0]) size = strtoul(row[0], nullptr, 10);
+                    mysql_free_result(res);
+                }
+            }
+            return size > 4096 ? size : 1UL << 20;
+        }
+
+        bool prepare_results(size_t n) {
+            if (results.empty()) {
+                unsigned int fields = mysql_stmt_field_count(stmt);
+                results.resize(fields);
+                columns.resize(fields);
+                for (unsigned int i = 0; i < fields; i++) {
+                    memset(&results[i], 0, sizeof(MYSQL_BIND));
+                    results[i].buffer_type = MYSQL_TYPE_NULL;
+                }
+                results_bound = false;
+            }
+            return n <= results.size();
+        }
+
+        void bind_result(size_t i, enum_field_types buffer_type, bool is_unsigned) {
+            MYSQL_BIND& b = results[i];
+            Column& c     = columns[i];
+            if (b.buffer && b.buffer_type == buffer_type && !!b.is_unsigned == is_unsigned) return;
+            memset(&b, 0, sizeof(MYSQL_BIND));
+            b.buffer_type = buffer_type;
+            b.is_unsigned = is_unsigned;
+            b.length      = &c.length;
+            b.is_null     = &c.null;
+            b.error       = &c.error;
+            if (buffer_type == MYSQL_TYPE_STRING) {
+                if (c.data.size() < 64) c.data.resize(64);
+                b.buffer        = c.data.data();
+                b.buffer_length = c.data.size();
+            } else {
+                b.buffer = &c.value;
+            }
+            results_bound = false;
+        }
+
+        inline void bind_result(size_t i, const int&)                { bind_result(i, MYSQL_TYPE_LONG, false); }
+        inline void bind_result(size_t i, const unsigned int&)       { bind_result(i, MYSQL_TYPE_LONG, true); }
+        inline void bind_result(size_t i, const long long&)          { bind_result(i, MYSQL_TYPE_LONGLONG, false); }
+        inline void bind_result(size_t i, const unsigned long long&) { bind_result(i, MYSQL_TYPE_LONGLONG, true); }
+        inline void bind_result(size_t i, const float&)              { bind_result(i, MYSQL_TYPE_FLOAT, false); }
+        inline void bind_result(size_t i, const double&)             { bind_result(i, MYSQL_TYPE_DOUBLE, false); }
+        inline void bind_result(size_t i, const std::string&)        { bind_result(i, MYSQL_TYPE_STRING, false); }
+
+        // no buffer, so the fetch only reports the length
+        inline void bind_result(size_t i, const LongColumn&) {
+            MYSQL_BIND& b = results[i];
+            Column& c     = columns[i];
+            if (b.buffer_type == MYSQL_TYPE_BLOB && !b.buffer && b.length == &c.length) return;
+            memset(&b, 0, sizeof(MYSQL_BIND));
+            b.buffer_type = MYSQL_TYPE_BLOB;
+            b.length      = &c.length;
+            b.is_null     = &c.null;
+            b.error       = &c.error;
+            results_bound = false;
+        }
+
+        inline void get_column(size_t i, int& x)                { x = columns[i].null ? 0 : columns[i].value.n; }
+        inline void get_column(size_t i, unsigned int& x)       { x = columns[i].null ? 0 : columns[i].value.u; }
+        inline void get_column(size_t i, long long& x)          { x = columns[i].null ? 0 : columns[i].value.ll; }
+        inline void get_column(size_t i, unsigned long long& x) { x = columns[i].null ? 0 : columns[i].value.ull; }
+        inline void get_column(size_t i, float& x)              { x = columns[i].null ? 0 : columns[i].value.f; }
+        inline void get_column(size_t i, double& x)             { x = columns[i].null ? 0 : columns[i].value.d; }
+        inline void get_column(size_t i, LongColumn& x) {
+            x.index  = i;
+            x.null   = columns[i].null;
+            x.length = x.null ? 0 : columns[i].length;
+        }
+        inline void get_column(size_t i, std::string& x) {
+            if (columns[i].null) x.clear();
+            else x.assign(columns[i].data.data(), columns[i].length);
+        }
+
+        // grow the buffers of string columns that did not fit and fetch them again
+        bool fetch_truncated() {
+            for (size_t i = 0; i < results.size(); i++) {
+                MYSQL_BIND& b = results[i];
+                Column& c     = columns[i];
+                if (b.buffer_type != MYSQL_TYPE_STRING || c.null || c.length <= b.buffer_length) continue;
+                c.data.resize(c.length);
+                b.buffer        = c.data.data();
+                b.buffer_length = c.data.size();
+                if (mysql_stmt_fetch_column(stmt, &b, i, 0)) return false;
+                results_bound = false;
+            }
+            return true;
+        }
+
+        template <class T, class... Types>
+        inline
+        void _bind_result(size_t n, const T& x, Types& ... args) {
+            bind_result(n, x);
+            _bind_result(n+1, args...);
+        }
+
+        inline
+        void _bind_result(size_t) {}
+
+        template <class T, class... Types>
+        inline
+        void _fetch(size_t n, T& x, Types& ... args) {
+            get_column(n, x);
+            _fetch(n+1, args...);
+        }
+
+        inline
+        void _fetch(size_t) {}
+
+        template <class Tuple, size_t... I>
+        bool fetch_tuple(Tuple& row, std::index_sequence<I...>) {
+            return fetch(std::get<I>(row)...);
+        }
+};
+
+template <class... Types>
+class StmtRows {
+    private:
+        Stmt* stmt;
+    public:
+        class iterator {
+            private:
+                Stmt* stmt;
+                std::tuple<Types...> row;
+            public:
+                iterator(Stmt* stmt) : stmt(stmt) {
+                    ++*this;
+                }
+
+                const std::tuple<Types...>& operator*() const { return row; }
+                std::tuple<Types...>& operator*() { return row; }
+
+                iterator& operator++() {
+                    if (stmt && !stmt->fetch(row)) stmt = nullptr;
+                    return *this;
+                }
+
+                bool operator==(const iterator& x) const { return stmt == x.stmt; }
+                bool operator!=(const iterator& x) const { return stmt != x.stmt; }
+        };
+
+        StmtRows(Stmt* stmt) : stmt(stmt) {}
+
+        iterator begin() { return iterator(stmt); }
+        iterator end() { return iterator(nullptr); }
+};
+
+template <class... Types>
+inline
+StmtRows<Types...> Stmt::rows()
+{
+    return StmtRows<Types...>(this);
+}
+
+// A statement whose parameter list is fixed at compile time:
+//
+//     static constexpr char insert_user[] = "INSERT INTO users (id, name) VALUES (?, ?)";
+//     PreparedQuery<insert_user, void(int64_t, std::string)> q(db);
+//     q.execute(1, "alice");
+//
+// The placeholders of SQL are counted at compile time and must match the
+// signature. Parameter types and bind layout are set up once; executing
+// copies the values into slots owned by the query and only rebinds when a
+// slot's buffer moves.
+template <const char* SQL, class Sig>
+class PreparedQuery;
+
+template <const char* SQL, class... Args>
+class PreparedQuery<SQL, void(Args...)> {
+        static_assert(count_placeholders(SQL) == sizeof...(Args),
+                      "number of ? placeholders in SQL does not match the parameter list");
+    private:
+        Stmt stmt;
+        std::tuple<typename param_traits<Args>::slot...> slots;
+        std::array<MYSQL_BIND, sizeof...(Args)> binds;
+        std::array<my_bool, sizeof...(Args)> nulls;
+        bool bound;
+    public:
+        PreparedQuery() : bound(false) {}
+
+        explicit PreparedQuery(mysql& db) : stmt(db.prepare(SQL)), bound(false) {
+            // the server's count, should SQL hold something the scan misreads
+            MYSQL_STMT* s = stmt.native_handle();
+            if (s && mysql_stmt_param_count(s) != sizeof...(Args)) {
+                std::cerr << "Error: " << mysql_stmt_param_count(s)
+                          << " placeholders in the prepared statement do not match the parameter list: " << SQL << "\n";
+                stmt = Stmt();
+            }
+            binds.fill(MYSQL_BIND());
+            init(std::index_sequence_for<Args...>{});
+        }
+
+        static constexpr const char* sql() {
+            return SQL;
+        }
+
+        explicit operator bool() const {
+            return stmt.native_handle() != nullptr;
+        }
+
+        // the same checks, accounting and cache invalidation as Stmt::execute
+        bool execute(const Args& ... args) {
+            bool moved = set_all(std::index_sequence_for<Args...>{}, args...);
+            bool ok = stmt.execute_binds(binds.data(), moved || !bound);
+            // after a failure it is unknown whether the library kept the binds
+            bound = ok;
+            return ok;
+        }
+
+        // for fetching results and affected rows
+        Stmt& statement() {
+            return stmt;
+        }
+
+    private:
+        template <size_t... I>
+        void init(std::index_sequence<I...>) {
+            ((binds[I].buffer_type = param_traits<Args>::type,
+              binds[I].is_unsigned = param_traits<Args>::is_unsigned), ...);
+        }
+
+        // whether any buffer the bound copy refers to has moved
+        template <size_t... I>
+        bool set_all(std::index_sequence<I...>, const Args& ... args) {
+            return (set<I>(args) | ... | false);
+        }
+
+        template <size_t I, class T>
+        bool set(const T& x) {
+            MYSQL_BIND& b = binds[I];
+            void* buffer = b.buffer;
+            unsigned long* length = b.length;
+            my_bool* is_null = b.is_null;
+            b.is_null = &nulls[I];
+            nulls[I] = 0;
+            param_traits<T>::set(b, std::get<I>(slots), x);
+            return b.buffer != buffer || b.length != length || b.is_null != is_null;
+        }
+};
+
+// Text protocol cell to number, without locale or allocation.
+//
+// Integer cells are converted eight digits at a time: the digits are loaded
+// as one little-endian word, checked together, and combined with three
+// multiplies instead of eight.
+inline
+bool parse_eight_digits(const char* s, uint64_t& out) {
+    uint64_t v;
+    memcpy(&v, s, 8);
+    if (((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+            != 0x3333333333333333ULL)
+        return false;
+    v -= 0x3030303030303030ULL;
+    v = v * 10 + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+        + (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    out = v;
+    return true;
+}
+
+// At most 19 digits, so the value always fits.
+inline
+bool parse_digits(const char* s, size_t n, uint64_t& out) {
+    uint64_t v = 0;
+    size_t i = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (uint64_t chunk; n - i >= 8; i += 8) {
+        if (!parse_eight_digits(s + i, chunk)) return false;
+        v = v * 100000000 + chunk;
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned d = (unsigned char)s[i] - '0';
+        if (d > 9) return false;
+        v = v * 10 + d;
+    }
+    out = v;
+    return true;
+}
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, bool>::type
+parse_value(const char* s, size_t n, T& out) {
+    const char* p = s;
+    size_t m = n;
+    bool neg = false;
+    if (m > 0 && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+        m--;
+    }
+    uint64_t v;
+    if (m == 0 || m > 19 || !parse_digits(p, m, v)) {
+        // long runs of leading zeros and the like; from_chars takes no '+',
+        // and must not see a sign after one
+        if (n > 1 && *s == '+' && unsigned((unsigned char)s[1] - '0') <= 9) { s++; n--; }
+        std::from_chars_result r = std::from_chars(s, s + n, out);
+        return r.ec == std::errc() && r.ptr == s + n;
+    }
+    if (neg) {
+        if (!std::is_signed<T>::value) return false;
+        if (v > uint64_t(std::numeric_limits<T>::max()) + 1) return false;
+        out = T(0 - v);
+    } else {
+        if (v > uint64_t(std::numeric_limits<T>::max())) return false;
+        out = T(v);
+    }
+    return true;
+}
+
+template <class T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+parse_value(const char* s, size_t n, T& out) {
+    if (n > 1 && *s == '+' && (unsigned((unsigned char)s[1] - '0') <= 9 || s[1] == '.')) { s++; n--; }
+    std::from_chars_result r = std::from_chars(s, s + n, out);
+    return r.ec == std::errc() && r.ptr == s + n;
+}
+
+class Row {
+    private:
+        MYSQL_ROW row;
+        unsigned long *lengths;
+    public:
+        Row() : row(nullptr), lengths(nullptr) {}
+        Row(MYSQL_ROW row, unsigned long* lengths) : row(row), lengths(lengths) {}
+
+        Row(Row&& x) noexcept : row(x.row), lengths(x.lengths) {
+            x.row     = nullptr;
+            x.lengths = nullptr;
+        }
+
+        Row& operator=(Row&& x) noexcept {
+            if (this != &x) {
+                row       = x.row;
+                lengths   = x.lengths;
+                x.row     = nullptr;
+                x.lengths = nullptr;
+            }
+            return *this;
+        }
+
+        operator bool() const {
+            return !!row;
+        }
+
+        std::string operator[](size_t n) const {
+            return std::string(row[n], lengths[n]);
+        }
+
+        // Non-owning view of column n, valid until the next fetch from the
+        // same Result. NULL columns give an empty view, see is_null().
+        std::string_view view(size_t n) const {
+            if (!row[n]) return std::string_view();
+            return std::string_view(row[n], lengths[n]);
+        }
+
+        bool is_null(size_t n) const {
+            return row[n] == nullptr;
+        }
+
+        // Column n converted straight from the row buffer. False when NULL
+        // or not a number of type T, leaving out untouched.
+        template <class T>
+        bool get(size_t n, T& out) const {
+            return row[n] && parse_value(row[n], lengths[n], out);
+        }
+
+        bool get(size_t n, std::string& out) const {
+            if (!row[n]) return false;
+            out.assign(row[n], lengths[n]);
+            return true;
+        }
+
+        bool get(size_t n, std::string_view& out) const {
+            if (!row[n]) return false;
+            out = std::string_view(row[n], lengths[n]);
+            return true;
+        }
+
+        // T{} when NULL or unparseable
+        template <class T>
+        T get(size_t n) const {
+            T out{};
+            get(n, out);
+            return out;
+        }
+};
+
+enum class ColumnKind { int64, float64, string };
+
+// One column of a result drained by Result::to_columns(), in the layout of
+// an Arrow array: contiguous values, a validity bitmap (bit i set when row
+// i is not NULL, least significant bit first) and, for strings, rows + 1
+// offsets into a single byte buffer (Arrow's LargeUtf8/LargeBinary).
+struct ColumnData {
+    std::string name;
+    ColumnKind kind;
+    std::vector<int64_t> ints;
+    std::vector<double> doubles;
+    std::vector<int64_t> offsets;
+    std::vector<char> bytes;
+    std::vector<uint8_t> validity;
+    size_t null_count = 0;
+
+    bool is_null(size_t i) const {
+        return !(validity[i / 8] & (1 << (i % 8)));
+    }
+
+    std::string_view str(size_t i) const {
+        return std::string_view(bytes.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+    // the column type as stored for MYSQL_FIELD f; exact or unsigned 64 bit
+    // values that don't fit int64 stay strings
+    static ColumnKind kind_of(const MYSQL_FIELD& f) {
+        switch (f.type) {
+            case MYSQL_TYPE_TINY: case MYSQL_TYPE_SHORT: case MYSQL_TYPE_LONG:
+            case MYSQL_TYPE_INT24: case MYSQL_TYPE_YEAR:
+                return ColumnKind::int64;
+            case MYSQL_TYPE_LONGLONG:
+                return (f.flags & UNSIGNED_FLAG) ? ColumnKind::string : ColumnKind::int64;
+            case MYSQL_TYPE_FLOAT: case MYSQL_TYPE_DOUBLE:
+                return ColumnKind::float64;
+            default:
+                return ColumnKind::string;
+        }
+    }
+};
+
+struct ColumnSet {
+    std::vector<ColumnData> columns;
+    size_t rows = 0;
+};
+
+// Field names of a result set, captured once per Result, with a sorted
+// name -> index table for named column access.
+class ColumnLayout {
+    private:
+        std::vector<std::string> names;
+        std::vector<size_t> order;
+    public:
+        static const size_t npos = size_t(-1);
+
+        ColumnLayout() {}
+        ColumnLayout(const MYSQL_FIELD* fields, size_t n) {
+            names.reserve(n);
+            for (size_t i = 0; i < n; i++) {
+                names.emplace_back(fields[i].name);
+                order.push_back(i);
+            }
+            std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+                return names[a] < names[b];
+            });
+        }
+
+        size_t size() const {
+            return names.size();
+        }
+
+        const std::string& name(size_t i) const {
+            return names[i];
+        }
+
+        // Index of the column called name, or npos. With duplicate names the
+        // last one wins, like the std::map built by Result::fetch_array().
+        size_t find(std::string_view name) const {
+            auto it = std::upper_bound(order.begin(), order.end(), name, [this](std::string_view x, size_t i) {
+                return x < std::string_view(names[i]);
+            });
+            if (it == order.begin() || names[*(it - 1)] != name) return npos;
+            return *(it - 1);
+        }
+};
+
+// A Row whose columns can also be looked up by name. Replaces the per-row
+// std::map of fetch_array(); only valid while its Result is alive.
+class NamedRow {
+    private:
+        Row row;
+        const ColumnLayout* layout;
+    public:
+        NamedRow() : layout(nullptr) {}
+        NamedRow(Row&& row, const ColumnLayout* layout) : row(std::move(row)), layout(layout) {}
+
+        explicit operator bool() const {
+            return !!row;
+        }
+
+        bool empty() const {
+            return !row;
+        }
+
+        const Row& columns() const {
+            return row;
+        }
+
+        size_t count(std::string_view name) const {
+            return layout->find(name) != ColumnLayout::npos;
+        }
+
+        // missing columns read as empty, as they would from the map
+        std::string operator[](std::string_view name) const {
+            return std::string(view(name));
+        }
+
+        std::string operator[](size_t n) const {
+            return row[n];
+        }
+
+        std::string_view view(std::string_view name) const {
+            size_t n = layout->find(name);
+            if (n == ColumnLayout::npos) return std::string_view();
+            return row.view(n);
+        }
+
+        std::string_view view(size_t n) const {
+            return row.view(n);
+        }
+
+        bool is_null(std::string_view name) const {
+            size_t n = layout->find(name);
+            return n == ColumnLayout::npos || row.is_null(n);
+        }
+
+        template <class T>
+        T get(std::string_view name) const {
+            size_t n = layout->find(name);
+            if (n == ColumnLayout::npos) return T{};
+            return row.get<T>(n);
+        }
+};
+
+// Bump allocator: memory comes out of large blocks and is released all at
+// once when the Arena is destroyed.
+class Arena {
+    private:
+        std::vector<std::unique_ptr<char[]>> blocks;
+        char* cur;
+        size_t left;
+        size_t block_size;
+        size_t used;
+    public:
+        Arena(size_t block_size = 64 * 1024) : cur(nullptr), left(0), block_size(block_size), used(0) {}
+
+        char* allocate(size_t n) {
+            used += n;
+            if (n > left) {
+                // big values get a block of their own so the current one keeps filling
+                if (n > block_size / 4) {
+                    blocks.emplace_back(new char[n]);
+                    return blocks.back().get();
+                }
+                blocks.emplace_back(new char[block_size]);
+                cur  = blocks.back().get();
+                left = block_size;
+            }
+            char* p = cur;
+            cur  += n;
+            left -= n;
+            return p;
+        }
+
+        // bytes handed out so far
+        size_t size() const {
+            return used;
+        }
+
+        // take over the blocks of x, so memory from either stays valid
+        void adopt(Arena&& x) {
+            for (std::unique_ptr<char[]>& b : x.blocks) blocks.push_back(std::move(b));
+            used += x.used;
+            x.blocks.clear();
+            x.cur  = nullptr;
+            x.left = 0;
+            x.used = 0;
+        }
+};
+
+// Rows copied out of a Result so they outlive it. Cell data lives in an
+// Arena, each row in one allocation, and reads as NUL-terminated
+// MYSQL_ROW-style cells through Row.
+class RowSet {
+    private:
+        std::shared_ptr<const ColumnLayout> layout;
+        size_t fields;
+        std::vector<char*> cells;
+        std::vector<unsigned long> lengths;
+        Arena arena;
+    public:
+        class iterator {
+            private:
+                const RowSet* set;
+                size_t i;
+            public:
+                iterator(const RowSet* set, size_t i) : set(set), i(i) {}
+                Row operator*() const { return (*set)[i]; }
+                iterator& operator++() { ++i; return *this; }
+                bool operator==(const iterator& x) const { return i == x.i; }
+                bool operator!=(const iterator& x) const { return i != x.i; }
+        };
+
+        RowSet() : fields(0) {}
+        RowSet(std::shared_ptr<const ColumnLayout> layout)
+            : layout(std::move(layout)), fields(this->layout ? this->layout->size() : 0) {}
+
+        void reserve(size_t rows) {
+            cells.reserve(rows * fields);
+            lengths.reserve(rows * fields);
+        }
+
+        // Move the rows of x, which must have the same columns, to the end
+        // without copying their cells.
+        void splice(RowSet&& x) {
+            if (!layout) {
+                layout = x.layout;
+                fields = x.fields;
+            }
+            cells.insert(cells.end(), x.cells.begin(), x.cells.end());
+            lengths.insert(lengths.end(), x.lengths.begin(), x.lengths.end());
+            arena.adopt(std::move(x.arena));
+            x.cells.clear();
+            x.lengths.clear();
+        }
+
+        void append(MYSQL_ROW row, const unsigned long* len) {
+            size_t total = 0;
+            for (size_t i = 0; i < fields; i++) total += row[i] ? len[i] + 1 : 0;
+            char* p = total ? arena.allocate(total) : nullptr;
+            for (size_t i = 0; i < fields; i++) {
+                if (!row[i]) {
+                    cells.push_back(nullptr);
+                    lengths.push_back(0);
+                    continue;
+                }
+                memcpy(p, row[i], len[i]);
+                p[len[i]] = 0;
+                cells.push_back(p);
+                lengths.push_back(len[i]);
+                p += len[i] + 1;
+            }
+        }
+
+        size_t size() const {
+            return fields ? cells.size() / fields : 0;
+        }
+
+        bool empty() const {
+            return cells.empty();
+        }
+
+        size_t num_fields() const {
+            return fields;
+        }
+
+        // cell bytes held, excluding the per-cell index
+        size_t memory() const {
+            return arena.size();
+        }
+
+        const ColumnLayout& columns() const {
+            return *layout;
+        }
+
+        // valid as long as the RowSet
+        Row operator[](size_t i) const {
+            return Row{const_cast<char**>(&cells[i * fields]), const_cast<unsigned long*>(&lengths[i * fields])};
+        }
+
+        NamedRow named(size_t i) const {
+            return NamedRow{(*this)[i], layout.get()};
+        }
+
+        // Column col of every row as integers, in one pass over the cells.
+        // NULL and non-integer cells store 0 and clear their bit in validity
+        // (LSB first, (size() + 7) / 8 bytes) when one is given. Returns the
+        // number of such cells.
+        size_t decode_column(size_t col, int64_t* out, uint8_t* validity = nullptr) const {
+            size_t rows = size(), bad = 0;
+            if (validity) memset(validity, 0xFF, (rows + 7) / 8);
+            const char* const* cell = cells.data() + col;
+            const unsigned long* len = lengths.data() + col;
+            for (size_t r = 0; r < rows; r++, cell += fields, len += fields) {
+                int64_t v = 0;
+                if (!*cell || !parse_value(*cell, *len, v)) {
+                    v = 0;
+                    bad++;
+                    if (validity) validity[r / 8] &= ~(1 << (r % 8));
+                }
+                out[r] = v;
+            }
+            return bad;
+        }
+
+        iterator begin() const { return iterator(this, 0); }
+        iterator end() const { return iterator(this, size()); }
+};
+
+// rows, bytes and timing of a streaming result still being read
+struct ResultWatch {
+    QueryTimer timer;
+    std::string sql;
+    bool started;
+};
+
+class Result {
+    private:
+        MYSQL_RES* res;
+        int num_fields;
+        bool buffered;
+        std::shared_ptr<const ColumnLayout> layout;
+        std::unique_ptr<ResultWatch> watcher;
+    public:
+        // Rows in order, fetched from the server only as the loop advances
+        // when the result is streaming.
+        class iterator {
+            private:
+                Result* result;
+                MYSQL_ROW row;
+                unsigned long* lengths;
+            public:
+                iterator(Result* result) : result(result), row(nullptr), lengths(nullptr) {
+                    ++*this;
+                }
+
+                Row operator*() const {
+                    return Row{row, lengths};
+                }
+
+                iterator& operator++() {
+                    row = result ? result->next_row() : nullptr;
+                    lengths = row ? mysql_fetch_lengths(result->res) : nullptr;
+                    if (!row) result = nullptr;
+                    return *this;
+                }
+
+                bool operator==(const iterator& x) const { return result == x.result && row == x.row; }
+                bool operator!=(const iterator& x) const { return !(*this == x); }
+        };
+
+        Result() : res(0), num_fields(0), buffered(false) {}
+        Result(MYSQL_RES* res, bool buffered = false)
+            : res(res), num_fields(mysql_num_fields(res)), buffered(buffered) {}
+        Result(Result&& r) noexcept
+            : res(r.res), num_fields(r.num_fields), buffered(r.buffered), layout(std::move(r.layout)),
+              watcher(std::move(r.watcher)) {
+            r.res = 0;
+        }
+
+        ~Result() {
+            unwatch();
+            if (res) mysql_free_result(res);
+        }
+
+        operator bool() {
+            return !!res;
+        }
+
+        Result& operator=(Result&& r) noexcept {
+            if (this == &r) return *this;
+            unwatch();
+            if (res) mysql_free_result(res);
+            res = r.res;
+            num_fields = r.num_fields;
+            buffered = r.buffered;
+            layout = std::move(r.layout);
+            watcher = std::move(r.watcher);
+            r.res = 0;
+            return *this;
+        }
+
+        // Finish timing of the query that produced this streaming result as
+        // its rows are read; reported when they run out or it is destroyed.
+        void watch(QueryTimer timer, std::string sql) {
+            watcher.reset(new ResultWatch{timer, std::move(sql), false});
+            watcher->timer.stats.sql = watcher->sql;
+        }
+
+        bool is_buffered() const {
+            return buffered;
+        }
+
+        MYSQL_RES* native_handle() const {
+            return res;
+        }
+
+        // all rows of a buffered result; for a streaming one, the rows
+        // fetched so far
+        my_ulonglong num_rows() const {
+            return res ? mysql_num_rows(res) : 0;
+        }
+
+        // move a buffered result to row n (0 based)
+        bool seek(my_ulonglong n) {
+            if (!res || !buffered || n >= mysql_num_rows(res)) return false;
+            mysql_data_seek(res, n);
+            return true;
+        }
+
+        iterator begin() {
+            return iterator(res ? this : nullptr);
+        }
+
+        iterator end() {
+            return iterator(nullptr);
+        }
+
+        Result& operator=(const Result&) = delete;
+        Result(const Result&) = delete;
+        // field metadata, read from the server result once and then shared
+        const ColumnLayout& columns() {
+            if (!layout) {
+                layout = std::make_shared<ColumnLayout>(res ? mysql_fetch_fields(res) : nullptr, res ? num_fields : 0);
+            }
+            return *layout;
+        }
+
+        std::map<std::string,std::string> fetch_array() {
+            Row row = fetch_row();
+            if (!row) return {};
+            return to_map(row, columns());
+        }
+
+        // the map fetch_array() builds for row
+        static std::map<std::string,std::string> to_map(const Row& row, const ColumnLayout& keys) {
+            std::map<std::string, std::string> data;
+            for(size_t i = 0; i < keys.size(); i++) {
+                data[keys.name(i)] = row[i];
+            }
+            return data;
+        }
+
+        // Copy the remaining rows into an arena-backed RowSet.
+        RowSet fetch_all() {
+            if (!res) return RowSet{};
+            columns();
+            RowSet set(layout);
+            if (buffered) set.reserve(mysql_num_rows(res));
+            while (MYSQL_ROW row = next_row()) {
+                set.append(row, mysql_fetch_lengths(res));
+            }
+            return set;
+        }
+
+        // Drain the remaining rows into one contiguous buffer per column.
+        ColumnSet to_columns() {
+            ColumnSet set;
+            if (!res) return set;
+            const ColumnLayout& names = columns();
+            MYSQL_FIELD* fields = mysql_fetch_fields(res);
+            size_t expect = buffered ? mysql_num_rows(res) : 0;
+            set.columns.resize(num_fields);
+            for (int i = 0; i < num_fields; i++) {
+                ColumnData& c = set.columns[i];
+                c.name = names.name(i);
+                c.kind = ColumnData::kind_of(fields[i]);
+                c.validity.reserve((expect + 7) / 8);
+                if (c.kind == ColumnKind::int64) c.ints.reserve(expect);
+                else if (c.kind == ColumnKind::float64) c.doubles.reserve(expect);
+                else {
+                    c.offsets.reserve(expect + 1);
+                    c.offsets.push_back(0);
+                }
+            }
+            size_t n = 0;
+            while (MYSQL_ROW row = next_row()) {
+                unsigned long* lengths = mysql_fetch_lengths(res);
+                for (int i = 0; i < num_fields; i++) {
+                    ColumnData& c = set.columns[i];
+                    if (n % 8 == 0) c.validity.push_back(0);
+                    bool valid = row[i] != nullptr;
+                    if (valid) c.validity.back() |= 1 << (n % 8);
+                    else c.null_count++;
+                    switch (c.kind) {
+                        case ColumnKind::int64: {
+                            int64_t v = 0;
+                            if (valid) parse_value(row[i], lengths[i], v);
+                            c.ints.push_back(v);
+                        } break;
+                        case ColumnKind::float64: {
+                            double v = 0;
+                            if (valid) parse_value(row[i], lengths[i], v);
+                            c.doubles.push_back(v);
+                        } break;
+                        case ColumnKind::string:
+                            if (valid) c.bytes.insert(c.bytes.end(), row[i], row[i] + lengths[i]);
+                            c.offsets.push_back(c.bytes.size());
+                            break;
+                    }
+                }
+                n++;
+            }
+            set.rows = n;
+            return set;
+        }
+
+        NamedRow fetch_named() {
+            const ColumnLayout& keys = columns();
+            return NamedRow{fetch_row(), &keys};
+        }
+        Row fetch_row() {
+            MYSQL_ROW row = next_row();
+            unsigned long* lengths = mysql_fetch_lengths(res);
+            return Row{row, lengths};
+        }
+
+        inline
+        Row next() {
+            return fetch_row();
+        }
+        inline
+        std::map<std::string,std::string> next_array() {
+            return fetch_array();
+        }
+        inline
+        NamedRow next_named() {
+            return fetch_named();
+        }
+
+    private:
+        MYSQL_ROW next_row() {
+            MYSQL_ROW row = mysql_fetch_row(res);
+            if (!watcher) return row;
+            QueryStats& stats = watcher->timer.stats;
+            if (!row) {
+                unwatch();
+                return row;
+            }
+            if (!watcher->started) {
+                watcher->timer.lap(stats.first_row);
+                watcher->started = true;
+            }
+            unsigned long* lengths = mysql_fetch_lengths(res);
+            for (int i = 0; i < num_fields; i++) stats.bytes_received += lengths[i];
+            stats.rows++;
+            return row;
+        }
+
+        void unwatch() {
+            if (!watcher) return;
+            QueryTimer& timer = watcher->timer;
+            timer.lap(timer.stats.drain);
+            timer.finish();
+            watcher.reset();
+        }
+};
+
+// Shared copies of read-only results, keyed by normalized SQL or by
+// prepared statement and parameters, split into shards that each hold an
+// LRU within their share of the byte budget. Entries expire after their
+// TTL and are dropped by invalidate() for any table they read; the
+// connections it is set on invalidate the tables of their own writes. Writes
+// by other clients, triggers and cascades are only bounded by the TTL.
+class ResultCache {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        ResultCache(size_t max_bytes = 64 << 20, std::chrono::milliseconds ttl = std::chrono::seconds(1),
+                    size_t shards = 16)
+            : ttl(ttl), shards(std::max<size_t>(shards, 1)), budget(max_bytes / this->shards.size()), epoch(0),
+              invalidated(), hit_count(0), miss_count(0) {}
+
+        ResultCache(const ResultCache&) = delete;
+        ResultCache& operator=(const ResultCache&) = delete;
+
+        // the entry for key if it has not expired, else nullptr
+        std::shared_ptr<const RowSet> get(const std::string& key) {
+            Shard& s = shard(key);
+            std::lock_guard<std::mutex> mg(s.mutex);
+            auto it = s.index.find(key);
+            if (it == s.index.end()) {
+                miss_count.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            if (it->second->expires <= clock::now()) {
+                s.erase(it->second);
+                miss_count.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            hit_count.fetch_add(1, std::memory_order_relaxed);
+            return it->second->rows;
+        }
+
+        // Take before running the statement whose rows will be put(): an
+        // invalidation of one of its tables in between could otherwise be
+        // overtaken by rows read before it, so put() then drops them.
+        uint64_t ticket() const {
+            return epoch.load();
+        }
+
+        // Keep rows under key for ttl, or the cache's default if zero, until
+        // one of tables is invalidated. Results larger than a shard's
+        // budget are not kept.
+        void put(const std::string& key, std::shared_ptr<const RowSet> rows, std::vector<std::string> tables,
+                 uint64_t ticket, std::chrono::milliseconds ttl = std::chrono::milliseconds(0)) {
+            if (!rows) return;
+            for (std::string& t : tables) {
+                for (char& c : t) c = tolower((unsigned char)c);
+            }
+            size_t bytes = sizeof(Entry) + 2 * key.size() + rows->memory()
+                         + rows->size() * rows->num_fields() * (sizeof(char*) + sizeof(unsigned long));
+            for (const std::string& t : tables) bytes += sizeof(void*) + t.size();
+            if (bytes > budget) return;
+            Shard& s = shard(key);
+            std::lock_guard<std::mutex> mg(s.mutex);
+            for (const std::string& t : tables) {
+                if (last_invalidated(t).load() > ticket) return;
+            }
+            auto it = s.index.find(key);
+            if (it != s.index.end()) s.erase(it->second);
+            while (!s.lru.empty() && s.bytes + bytes > budget) s.erase(std::prev(s.lru.end()));
+            s.lru.push_front(Entry{key, std::move(rows), clock::now() + (ttl.count() ? ttl : this->ttl), bytes,
+                                   std::move(tables)});
+            Entry& e = s.lru.front();
+            s.index[e.key] = s.lru.begin();
+            for (const std::string& t : e.tables) s.by_table[t].insert(&e);
+            s.bytes += bytes;
+        }
+
+        // drop every entry that read table, named as tables_of() reports it
+        void invalidate(std::string_view table) {
+            std::string name(table);
+            for (char& c : name) c = tolower((unsigned char)c);
+            raise(last_invalidated(name), epoch.fetch_add(1) + 1);
+            for (Shard& s : shards) {
+                std::lock_guard<std::mutex> mg(s.mutex);
+                for (auto it = s.by_table.find(name); it != s.by_table.end(); it = s.by_table.find(name)) {
+                    s.erase(s.index.find((*it->second.begin())->key)->second);
+                }
+            }
+        }
+
+        void invalidate(const std::vector<std::string>& tables) {
+            for (const std::string& t : tables) invalidate(t);
+        }
+
+        void clear() {
+            uint64_t now = epoch.fetch_add(1) + 1;
+            for (std::atomic<uint64_t>& e : invalidated) raise(e, now);
+            for (Shard& s : shards) {
+                std::lock_guard<std::mutex> mg(s.mutex);
+                s.index.clear();
+                s.by_table.clear();
+                s.lru.clear();
+                s.bytes = 0;
+            }
+        }
+
+        size_t size() const {
+            size_t n = 0;
+            for (const Shard& s : shards) {
+                std::lock_guard<std::mutex> mg(s.mutex);
+                n += s.lru.size();
+            }
+            return n;
+        }
+
+        // approximate memory held by the entries
+        size_t bytes() const {
+            size_t n = 0;
+            for (const Shard& s : shards) {
+                std::lock_guard<std::mutex> mg(s.mutex);
+                n += s.bytes;
+            }
+            return n;
+        }
+
+        uint64_t hits() const {
+            return hit_count.load(std::memory_order_relaxed);
+        }
+
+        uint64_t misses() const {
+            return miss_count.load(std::memory_order_relaxed);
+        }
+
+        // sql with runs of space outside quotes collapsed and a trailing
+        // semicolon dropped, so formatting does not split entries
+        static std::string normalize(std::string_view sql) {
+            std::string out;
+            out.reserve(sql.size());
+            char quote = 0;
+            for (size_t i = 0; i < sql.size(); i++) {
+                char c = sql[i];
+                if (quote) {
+                    out += c;
+                    if (c == '\\' && quote != '`' && i + 1 < sql.size()) out += sql[++i];
+                    else if (c == quote) quote = 0;
+                } else if (isspace((unsigned char)c)) {
+                    if (!out.empty() && out.back() != ' ') out += ' ';
+                } else {
+                    if (c == '\'' || c == '"' || c == '`') quote = c;
+                    out += c;
+                }
+            }
+            while (!out.empty() && (out.back() == ' ' || out.back() == ';')) out.pop_back();
+            return out;
+        }
+
+        // Key of sql run with args, in database with the SET SESSION
+        // assignments session, as the same text may give other rows
+        // under either. See mysql::set_session.
+        template <class... Types>
+        static std::string key(std::string_view database, std::string_view session, std::string_view sql,
+                               const Types& ... args) {
+            std::string k;
+            append_key(k, database);
+            append_key(k, session);
+            k += normalize(sql);
+            (append_key(k, args), ...);
+            return k;
+        }
+
+    private:
+        struct Entry {
+            std::string key;
+            std::shared_ptr<const RowSet> rows;
+            clock::time_point expires;
+            size_t bytes;
+            std::vector<std::string> tables;
+        };
+
+        struct Shard {
+            mutable std::mutex mutex;
+            std::list<Entry> lru;
+            std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+            // entries by the tables they read
+            std::unordered_map<std::string, std::unordered_set<Entry*>> by_table;
+            size_t bytes = 0;
+
+            void erase(std::list<Entry>::iterator it) {
+                for (const std::string& t : it->tables) {
+                    auto found = by_table.find(t);
+                    if (found == by_table.end()) continue;
+                    found->second.erase(&*it);
+                    if (found->second.empty()) by_table.erase(found);
+                }
+                bytes -= it->bytes;
+                index.erase(it->key);
+                lru.erase(it);
+            }
+        };
+
+        std::chrono::milliseconds ttl;
+        std::vector<Shard> shards;
+        size_t budget;
+        // counts invalidations; a ticket is its value
+        std::atomic<uint64_t> epoch;
+        // epoch of the last invalidation of the tables hashing to each slot,
+        // so one table's writes void no put() of rows from others
+        std::array<std::atomic<uint64_t>, 256> invalidated;
+        std::atomic<uint64_t> hit_count;
+        std::atomic<uint64_t> miss_count;
+
+        Shard& shard(const std::string& key) {
+            return shards[std::hash<std::string>()(key) % shards.size()];
+        }
+
+        // of a lowercase table name
+        std::atomic<uint64_t>& last_invalidated(const std::string& table) {
+            return invalidated[std::hash<std::string>()(table) % invalidated.size()];
+        }
+
+        static void raise(std::atomic<uint64_t>& e, uint64_t to) {
+            uint64_t was = e.load();
+            while (was < to && !e.compare_exchange_weak(was, to)) {}
+        }
+
+        // each value tagged and length-prefixed so keys can't run together
+        static void append_raw(std::string& k, char tag, const void* p, size_t n) {
+            k += '\0';
+            k += tag;
+            k.append((const char*)p, n);
+        }
+
+        static void append_bytes(std::string& k, char tag, const void* p, size_t n) {
+            uint64_t size = n;
+            append_raw(k, tag, &size, sizeof(size));
+            k.append((const char*)p, n);
+        }
+
+        template <class T>
+        static typename std::enable_if<std::is_arithmetic<T>::value>::type append_key(std::string& k, const T& x) {
+            append_raw(k, std::is_floating_point<T>::value ? 'f' : std::is_signed<T>::value ? 'i' : 'u', &x, sizeof(x));
+        }
+
+        static void append_key(std::string& k, std::string_view x) { append_bytes(k, 's', x.data(), x.size()); }
+        static void append_key(std::string& k, const std::string& x) { append_bytes(k, 's', x.data(), x.size()); }
+        static void append_key(std::string& k, const char* x) { append_key(k, std::string_view(x)); }
+        static void append_key(std::string& k, const Blob& x) { append_bytes(k, 'b', x.data, x.size); }
+
+        static void append_key(std::string& k, const MYSQL_TIME& x) {
+            unsigned long f[] = {x.year, x.month, x.day, x.hour, x.minute, x.second, x.second_part,
+                                 (unsigned long)x.neg, (unsigned long)x.time_type};
+            append_raw(k, 't', f, sizeof(f));
+        }
+
+        static void append_key(std::string& k, std::chrono::system_clock::time_point x) {
+            long long us = std::chrono::duration_cast<std::chrono::microseconds>(x.time_since_epoch()).count();
+            append_raw(k, 'c', &us, sizeof(us));
+        }
+
+        template <class T>
+        static void append_key(std::string& k, const std::optional<T>& x) {
+            if (x) append_key(k, *x);
+            else append_raw(k, 'n', nullptr, 0);
+        }
+};
+
+inline
+RowSet Stmt::fetch_all()
+{
+    if (stale()) {
+        std::cerr << "Error: statement outlived its connection\n";
+        return RowSet{};
+    }
+    if (owner) owner->check();
+    MYSQL_RES* meta = stmt ? mysql_stmt_result_metadata(stmt) : nullptr;
+    if (!meta) return RowSet{};
+    unsigned int fields = mysql_num_fields(meta);
+    RowSet set(std::make_shared<ColumnLayout>(mysql_fetch_fields(meta), fields));
+    mysql_free_result(meta);
+    if (!prepare_results(fields)) return set;
+    // the client library converts other types to text
+    for (unsigned int i = 0; i < fields; i++) bind_result(i, MYSQL_TYPE_STRING, false);
+    std::vector<char*> cells(fields);
+    std::vector<unsigned long> lengths(fields);
+    for (;;) {
+        if (!results_bound) {
+            if (mysql_stmt_bind_result(stmt, results.data())) {
+                std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+                break;
+            }
+            results_bound = true;
+        }
+        int x = mysql_stmt_fetch(stmt);
+        if (x == MYSQL_NO_DATA) break;
+        if (x == 1 || (x == MYSQL_DATA_TRUNCATED && !fetch_truncated())) {
+            note_error();
+            std::cerr << "Error: " << mysql_stmt_error(stmt) << "\n";
+            break;
+        }
+        for (unsigned int i = 0; i < fields; i++) {
+            cells[i]   = columns[i].null ? nullptr : columns[i].data.data();
+            lengths[i] = columns[i].null ? 0 : columns[i].length;
+        }
+        set.append(cells.data(), lengths.data());
+    }
+    return set;
+}
+
+template <class... Types>
+inline
+std::shared_ptr<const RowSet> Stmt::query_cached(const Types& ... args)
+{
+    // parameters bound beforehand are not part of the key
+    bool cached = cache && !writes && (sizeof...(Types) != 0 || count == 0);
+    std::string key;
+    uint64_t ticket = 0;
+    if (cached) {
+        key = ResultCache::key(database, session ? *session : std::string(), sql, args...);
+        if (std::shared_ptr<const RowSet> hit = cache->get(key)) return hit;
+        ticket = cache->ticket();
+    }
+    if (!execute(args...)) return nullptr;
+    std::shared_ptr<const RowSet> rows = std::make_shared<const RowSet>(fetch_all());
+    if (cached) cache->put(key, rows, tables, ticket);
+    return rows;
+}
+
+inline
+void Stmt::invalidate_cache()
+{
+    cache->invalidate(tables);
+}
+
+inline
+Result mysql::use_result()
+{
+    MYSQL_RES* result = mysql_use_result(handle);
+    if (!result) {
+        return Result{};
+    }
+    return Result{result};
+}
+
+inline
+Result mysql::store_result()
+{
+    MYSQL_RES* result = mysql_store_result(handle);
+    if (!result) {
+        return Result{};
+    }
+    return Result{result, true};
+}
+
+inline
+int mysql::next_result()
+{
+    int x = mysql_next_result(handle);
+    return x;
+}
+
+inline
+Stmt mysql::prepare_unlocked(const std::string& s, QueryTimer& timer)
+{
+    timer.stats.bytes_sent = s.size();
+    MYSQL_STMT* stmt = mysql_stmt_init(handle);
+    if (!stmt) {
+        note_error(mysql_errno(handle));
+        if (timer) timer.fail(mysql_errno(handle), mysql_error(handle));
+        timer.finish();
+        return Stmt{};
+    }
+    int x = mysql_stmt_prepare(stmt, s.c_str(), s.size());
+    timer.lap(timer.stats.server);
+    if (x != 0) {
+        note_error(mysql_stmt_errno(stmt));
+        if (timer) timer.fail(mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+        timer.finish();
+        mysql_stmt_close(stmt);
+        return Stmt{};
+    }
+    timer.finish();
+    return Stmt{handle, stmt, s, observer, alive, cache, &owner, database, &session_scope};
+}
+
+Stmt mysql::prepare(std::string s) {
+    QueryTimer timer(observer, QueryKind::prepare, s);
+    Guard mg(*this);
+    revive();
+    timer.lap(timer.stats.lock_wait);
+    return prepare_unlocked(s, timer);
+}
+
+inline
+std::shared_ptr<Stmt> mysql::prepare_cached(const std::string& s)
+{
+    QueryTimer timer(observer, QueryKind::prepare, s);
+    Guard mg(*this);
+    revive();
+    timer.lap(timer.stats.lock_wait);
+    auto it = stmt_index.find(s);
+    if (it != stmt_index.end()) {
+        stmt_lru.splice(stmt_lru.begin(), stmt_lru, it->second);
+        return it->second->second;
+    }
+    std::shared_ptr<Stmt> stmt = std::make_shared<Stmt>(prepare_unlocked(s, timer));
+    if (!*stmt) return nullptr;
+    if (stmt_cache_size == 0) return stmt;
+    stmt_lru.emplace_front(s, stmt);
+    stmt_index[s] = stmt_lru.begin();
+    trim_stmt_cache();
+    return stmt;
+}
+
+inline
+void mysql::restore_stmt(const std::string& s)
+{
+    if (stmt_index.count(s) || stmt_lru.size() >= stmt_cache_size || !is_open_unlocked()) return;
+    QueryTimer timer(observer, QueryKind::prepare, s);
+    std::shared_ptr<Stmt> stmt = std::make_shared<Stmt>(prepare_unlocked(s, timer));
+    if (!*stmt) return;
+    stmt_lru.emplace_back(s, stmt);
+    stmt_index[s] = std::prev(stmt_lru.end());
+}
+
+Result mysql::query(std::string s, ResultMode mode) {
+    if (!cache || is_read_only(s)) return run_query(std::move(s), mode);
+    std::vector<std::string> tables = tables_of(s);
+    bool use = uses_database(s);
+    Result result = run_query(std::move(s), mode);
+    // even on error: an earlier statement of several may have run
+    cache->invalidate(tables);
+    if (use) {
+        Guard mg(*this);
+        // not while rows or further results are still to be read
+        reread_database(handle && !result && !mysql_more_results(handle));
+    }
+    return result;
+}
+
+inline
+std::shared_ptr<const RowSet> mysql::query_cached(std::string s, std::chrono::milliseconds ttl)
+{
+    if (!cache || !is_read_only(s)) {
+        Result result = query(std::move(s), ResultMode::buffered);
+        return result ? std::make_shared<const RowSet>(result.fetch_all()) : nullptr;
+    }
+    std::string key;
+    {
+        Guard mg(*this);
+        key = ResultCache::key(database, session_scope, s);
+    }
+    if (std::shared_ptr<const RowSet> hit = cache->get(key)) return hit;
+    uint64_t ticket = cache->ticket();
+    std::vector<std::string> tables = tables_of(s);
+    Result result = run_query(std::move(s), ResultMode::buffered);
+    if (!result) return nullptr;
+    std::shared_ptr<const RowSet> rows = std::make_shared<const RowSet>(result.fetch_all());
+    cache->put(key, rows, std::move(tables), ticket, ttl);
+    return rows;
+}
+
+inline
+Result mysql::run_query(std::string s, ResultMode mode)
+{
+    QueryTimer timer(observer, QueryKind::query, s);
+    Guard mg(*this);
+    revive();
+    if (!timer) {
+        int x = mysql_real_query(handle, s.c_str(), s.size());
+        if (x != 0) {
+            note_error(mysql_errno(handle));
+            std::cerr << "Error: " << mysql_error(handle) << "\n";
+            return Result{};
+        }
+        return mode == ResultMode::buffered ? store_result() : use_result();
+    }
+    // the same as mysql_real_query, in two steps so they can be timed apart
+    timer.lap(timer.stats.lock_wait);
+    timer.stats.bytes_sent = s.size();
+    int x = mysql_send_query(handle, s.c_str(), s.size());
+    timer.lap(timer.stats.send);
+    if (x == 0) {
+        x = mysql_read_query_result(handle);
+        timer.lap(timer.stats.server);
+    }
+    if (x != 0) {
+        note_error(mysql_errno(handle));
+        timer.fail(mysql_errno(handle), mysql_error(handle));
+        timer.finish();
+        return Result{};
+    }
+    if (mode == ResultMode::streaming) {
+        Result result = use_result();
+        if (!result) {
+            if (mysql_field_count(handle)) timer.fail(mysql_errno(handle), mysql_error(handle));
+            else timer.stats.rows = mysql_affected_rows(handle);
+            timer.finish();
+        } else {
+            result.watch(std::move(timer), std::move(s));
+        }
+        return result;
+    }
+    Result result = store_result();
+    timer.lap(timer.stats.drain);
+    if (MYSQL_RES* res = result.native_handle()) {
+        timer.stats.rows = mysql_num_rows(res);
+        unsigned int fields = mysql_num_fields(res);
+        while (mysql_fetch_row(res)) {
+            unsigned long* lengths = mysql_fetch_lengths(res);
+            for (unsigned int i = 0; i < fields; i++) timer.stats.bytes_received += lengths[i];
+        }
+        mysql_data_seek(res, 0);
+    } else if (mysql_field_count(handle)) {
+        timer.fail(mysql_errno(handle), mysql_error(handle));
+    } else {
+        timer.stats.rows = mysql_affected_rows(handle);
+    }
+    timer.finish();
+    return result;
+}
+
+// Text layouts for Exporter and bulk_load(). tsv is the LOAD DATA default:
+// tab separated, backslash escapes, NULL as \N. csv follows RFC 4180 with
+// \n line ends: fields holding a comma, quote or line break are quoted, and
+// NULL is an empty field while an empty string is "".
+enum class TextFormat { tsv, csv };
+
+// Write cell s of n bytes, or NULL if s is null, to out in the given
+// format and return the end. Needs room for text_bound(n) bytes.
+inline
+char* write_tsv(char* out, const char* s, size_t n) {
+    // the escape letter of each byte needing a backslash
+    static const struct Table {
+        char e[256];
+        Table() : e() {
+            e[(unsigned char)'\\'] = '\\';
+            e[(unsigned char)'\t'] = 't';
+            e[(unsigned char)'\n'] = 'n';
+            e[(unsigned char)'\r'] = 'r';
+            e[0] = '0';
+        }
+    } table;
+    if (!s) {
+        *out++ = '\\';
+        *out++ = 'N';
+        return out;
+    }
+    for (size_t i = 0; i < n; i++) {
+        char e = table.e[(unsigned char)s[i]];
+        if (!e) {
+            *out++ = s[i];
+            continue;
+        }
+        *out++ = '\\';
+        *out++ = e;
+    }
+    return out;
+}
+
+inline
+char* write_csv(char* out, const char* s, size_t n) {
+    if (!s) return out;
+    bool quote = n == 0;
+    for (size_t i = 0; i < n && !quote; i++) {
+        quote = s[i] == ',' || s[i] == '"' || s[i] == '\n' || s[i] == '\r';
+    }
+    if (!quote) {
+        memcpy(out, s, n);
+        return out + n;
+    }
+    *out++ = '"';
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '"') *out++ = '"';
+        *out++ = s[i];
+    }
+    *out++ = '"';
+    return out;
+}
+
+inline
+size_t text_bound(size_t n) {
+    return 2 * n + 2;
+}
+
+inline
+char* write_text(char* out, TextFormat format, const char* s, size_t n) {
+    return format == TextFormat::tsv ? write_tsv(out, s, n) : write_csv(out, s, n);
+}
+
+inline
+void append_text(std::string& out, TextFormat format, const char* s, size_t n) {
+    size_t start = out.size();
+    out.resize(start + text_bound(n));
+    out.resize(write_text(&out[start], format, s, n) - out.data());
+}
+
+// Writes rows as text to a file descriptor. Rows are formatted straight
+// from the row buffers of a Result into one large buffer while a writer
+// thread hands the ones already filled to writev(), so fetching,
+// formatting and writing overlap. The descriptor is not closed.
+class Exporter {
+    public:
+        Exporter(int fd, TextFormat format = TextFormat::tsv, size_t buffer_size = 1 << 20, size_t buffers = 4)
+            : fd(fd), format(format), buffer_size(std::max<size_t>(buffer_size, 4096)),
+              buffers(std::max<size_t>(buffers, 2)), current(fresh(this->buffer_size)), writing(0), done(false),
+              finished(false), err(0) {}
+
+        ~Exporter() {
+            finish();
+        }
+
+        Exporter(const Exporter&) = delete;
+        Exporter& operator=(const Exporter&) = delete;
+
+        // a line of column names
+        void header(const ColumnLayout& columns) {
+            std::string line;
+            for (size_t i = 0; i < columns.size(); i++) {
+                if (i) line += separator();
+                const std::string& name = columns.name(i);
+                append_text(line, format, name.data(), name.size());
+            }
+            line += '\n';
+            reserve(line.size());
+            memcpy(current.data.get() + current.used, line.data(), line.size());
+            current.used += line.size();
+        }
+
+        void row(const Row& row, size_t fields) {
+            size_t need = fields + 1;
+            for (size_t i = 0; i < fields; i++) need += text_bound(row.view(i).size());
+            reserve(need);
+            char* p = current.data.get() + current.used;
+            for (size_t i = 0; i < fields; i++) {
+                if (i) *p++ = separator();
+                std::string_view v = row.view(i);
+                p = write_text(p, format, row.is_null(i) ? nullptr : v.data(), v.size());
+            }
+            *p++ = '\n';
+            current.used = p - current.data.get();
+            if (current.used >= buffer_size) hand_off();
+        }
+
+        // Write the remaining rows of result, after a header line if asked.
+        // Returns the number of rows, or -1 once a write has failed.
+        long long write(Result& result, bool header = false) {
+            if (!result) return 0;
+            const ColumnLayout& columns = result.columns();
+            size_t fields = columns.size();
+            if (header) this->header(columns);
+            long long n = 0;
+            for (Row r : result) {
+                row(r, fields);
+                n++;
+                if ((n & 1023) == 0 && failed()) return -1;
+            }
+            return failed() ? -1 : n;
+        }
+
+        // Write out everything buffered and stop the writer. Returns false
+        // if any write failed; error() has its errno.
+        bool finish() {
+            if (finished) return err == 0;
+            finished = true;
+            if (!writer.joinable()) {
+                // never filled a buffer, so no thread was needed
+                iovec v{current.data.get(), current.used};
+                if (current.used && !write_all(&v, 1)) err = errno;
+            } else {
+                if (current.used) hand_off();
+                {
+                    std::lock_guard<std::mutex> mg(mutex);
+                    done = true;
+                }
+                ready.notify_all();
+                writer.join();
+            }
+            if (err) std::cerr << "Error: export write failed: " << strerror(err) << "\n";
+            return err == 0;
+        }
+
+        int error() const {
+            std::lock_guard<std::mutex> mg(mutex);
+            return err;
+        }
+
+    private:
+        struct Chunk {
+            std::unique_ptr<char[]> data;
+            size_t used;
+            size_t capacity;
+        };
+
+        int fd;
+        TextFormat format;
+        size_t buffer_size;
+        // filled, being written and being filled, at most
+        size_t buffers;
+        Chunk current;
+        std::deque<Chunk> full;
+        std::vector<Chunk> spare;
+        size_t writing;
+        mutable std::mutex mutex;
+        std::condition_variable ready;
+        std::condition_variable drained;
+        std::thread writer;
+        bool done;
+        bool finished;
+        int err;
+
+        // room past buffer_size so most rows fit before the hand off
+        static Chunk fresh(size_t size) {
+            size_t capacity = size + size / 4;
+            return Chunk{std::unique_ptr<char[]>(new char[capacity]), 0, capacity};
+        }
+
+        char separator() const {
+            return format == TextFormat::tsv ? '\t' : ',';
+        }
+
+        bool failed() const {
+            std::lock_guard<std::mutex> mg(mutex);
+            return err != 0;
+        }
+
+        // make room for n more bytes in current
+        void reserve(size_t n) {
+            if (current.used + n <= current.capacity) return;
+            if (current.used) hand_off();
+            if (n > current.capacity) current = fresh(n);
+        }
+
+        // queue the current buffer for the writer and start on a free one
+        void hand_off() {
+            if (!writer.joinable()) writer = std::thread([this] { run(); });
+            std::unique_lock<std::mutex> lk(mutex);
+            drained.wait(lk, [this] { return full.size() + writing + 1 < buffers; });
+            full.push_back(std::move(current));
+            if (spare.empty()) {
+                lk.unlock();
+                current = fresh(buffer_size);
+            } else {
+                current = std::move(spare.back());
+                spare.pop_back();
+                lk.unlock();
+            }
+            ready.notify_one();
+        }
+
+        void run() {
+            std::vector<Chunk> batch;
+            std::vector<iovec> iov;
+            std::unique_lock<std::mutex> lk(mutex);
+            for (;;) {
+                ready.wait(lk, [this] { return !full.empty() || done; });
+                if (full.empty()) break;
+                while (!full.empty()) {
+                    batch.push_back(std::move(full.front()));
+                    full.pop_front();
+                }
+                writing = batch.size();
+                bool ok = err == 0;
+                lk.unlock();
+                iov.clear();
+                for (Chunk& c : batch) iov.push_back(iovec{c.data.get(), c.used});
+                // after a failure the rest is dropped so the producer never blocks
+                if (ok && !write_all(iov.data(), iov.size())) ok = false;
+                int e = errno;
+                lk.lock();
+                if (!ok && err == 0) err = e;
+                for (Chunk& c : batch) {
+                    c.used = 0;
+                    // oversized buffers of single huge rows are not kept
+                    if (c.capacity <= buffer_size + buffer_size / 4) spare.push_back(std::move(c));
+                }
+                batch.clear();
+                writing = 0;
+                drained.notify_all();
+            }
+        }
+
+        bool write_all(iovec* iov, size_t n) {
+            while (n > 0) {
+                ssize_t x = writev(fd, iov, std::min<size_t>(n, IOV_MAX));
+                if (x < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                size_t left = x;
+                while (n > 0 && left >= iov->iov_len) {
+                    left -= iov->iov_len;
+                    iov++;
+                    n--;
+                }
+                if (n > 0) {
+                    iov->iov_base = (char*)iov->iov_base + left;
+                    iov->iov_len -= left;
+                }
+            }
+            return true;
+        }
+};
+
+// Rows of a bulk_load(), formatted as LOAD DATA reads them by default.
+class LoadWriter {
+    public:
+        template <class T, class... Types>
+        void row(const T& first, const Types& ... rest) {
+            field(first);
+            ((buf += '\t', field(rest)), ...);
+            buf += '\n';
+        }
+
+        template <class... Types>
+        void row(const std::tuple<Types...>& x) {
+            std::apply([this](const Types& ... fields) { row(fields...); }, x);
+        }
+
+        void row(const Row& r, size_t fields) {
+            for (size_t i = 0; i < fields; i++) {
+                if (i) buf += '\t';
+                std::string_view v = r.view(i);
+                put(r.is_null(i) ? nullptr : v.data(), v.size());
+            }
+            buf += '\n';
+        }
+
+        // bytes waiting to be sent, so a producer can stop at a chunk size
+        size_t size() const {
+            return buf.size();
+        }
+
+    private:
+        friend struct LoadSource;
+
+        std::string buf;
+
+        void put(const char* s, size_t n) {
+            size_t start = buf.size();
+            buf.resize(start + text_bound(n));
+            buf.resize(write_tsv(&buf[start], s, n) - buf.data());
+        }
+
+        template <class T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type field(const T& x) {
+            char tmp[64];
+            std::to_chars_result r = std::to_chars(tmp, tmp + sizeof(tmp), x);
+            buf.append(tmp, r.ptr - tmp);
+        }
+
+        void field(bool x) { buf += x ? '1' : '0'; }
+        void field(std::string_view x) { put(x.data(), x.size()); }
+        void field(const std::string& x) { put(x.data(), x.size()); }
+        void field(const char* x) { put(x, x ? strlen(x) : 0); }
+        void field(const Blob& x) { put((const char*)x.data, x.size); }
+        void field(std::nullptr_t) { put(nullptr, 0); }
+
+        void field(const MYSQL_TIME& t) {
+            char tmp[64];
+            int n;
+            if (t.time_type == MYSQL_TIMESTAMP_DATE) {
+                n = snprintf(tmp, sizeof(tmp), "%04u-%02u-%02u", t.year, t.month, t.day);
+            } else if (t.time_type == MYSQL_TIMESTAMP_TIME) {
+                n = snprintf(tmp, sizeof(tmp), "%s%02u:%02u:%02u.%06lu", t.neg ? "-" : "", t.hour, t.minute, t.second,
+                             (unsigned long)t.second_part);
+            } else {
+                n = snprintf(tmp, sizeof(tmp), "%04u-%02u-%02u %02u:%02u:%02u.%06lu", t.year, t.month, t.day, t.hour,
+                             t.minute, t.second, (unsigned long)t.second_part);
+            }
+            buf.append(tmp, std::min<size_t>(n, sizeof(tmp) - 1));
+        }
+
+        // as UTC, like a time_point statement parameter
+        void field(std::chrono::system_clock::time_point x) {
+            MYSQL_BIND b;
+            MYSQL_TIME t;
+            param_traits<std::chrono::system_clock::time_point>::set(b, t, x);
+            field(t);
+        }
+
+        template <class T>
+        void field(const std::optional<T>& x) {
+            if (x) field(*x);
+            else put(nullptr, 0);
+        }
+};
+
+template <class Produce>
+inline
+typename std::enable_if<std::is_invocable_r<bool, Produce&, LoadWriter&>::value, long long>::type
+mysql::bulk_load(const std::string& table, const std::vector<std::string>& columns, Produce produce)
+{
+    return load_data(table, columns, std::function<bool(LoadWriter&)>(std::ref(produce)));
+}
+
+template <class Container>
+inline
+typename std::enable_if<!std::is_invocable_r<bool, Container&, LoadWriter&>::value, long long>::type
+mysql::bulk_load(const std::string& table, const std::vector<std::string>& columns, const Container& rows)
+{
+    auto it = rows.begin();
+    auto end = rows.end();
+    size_t fields = columns.size();
+    if constexpr (std::is_same<Container, RowSet>::value) fields = rows.num_fields();
+    return load_data(table, columns, [&](LoadWriter& out) {
+        for (; it != end && out.size() < 256 * 1024; ++it) {
+            if constexpr (std::is_same<typename std::decay<decltype(*it)>::type, Row>::value) out.row(*it, fields);
+            else out.row(*it);
+        }
+        return it != end;
+    });
+}
+
+// Feeds the LOAD DATA LOCAL INFILE request of bulk_load() from a producer.
+struct LoadSource {
+    std::function<bool(LoadWriter&)>* produce;
+    LoadWriter out;
+    size_t pos;
+    bool more;
+    uint64_t sent;
+
+    static int init(void** ptr, const char*, void* userdata) {
+        *ptr = userdata;
+        return 0;
+    }
+
+    static int read(void* ptr, char* buf, unsigned int length) {
+        LoadSource& s = *(LoadSource*)ptr;
+        while (s.pos == s.out.buf.size() && s.more) {
+            s.out.buf.clear();
+            s.pos  = 0;
+            s.more = (*s.produce)(s.out);
+        }
+        size_t n = std::min<size_t>(length, s.out.buf.size() - s.pos);
+        memcpy(buf, s.out.buf.data() + s.pos, n);
+        s.pos  += n;
+        s.sent += n;
+        return (int)n;
+    }
+
+    static void end(void*) {}
+
+    static int error(void*, char* msg, unsigned int length) {
+        snprintf(msg, length, "bulk_load source failed");
+        return CR_UNKNOWN_ERROR;
+    }
+};
+
+// `name`, or `db`.`name` for db.name
+inline
+void append_identifier(std::string& out, std::string_view name) {
+    size_t dot = name.find('.');
+    if (dot != std::string_view::npos && name.find('`') == std::string_view::npos) {
+        append_identifier(out, name.substr(0, dot));
+        out += '.';
+        name.remove_prefix(dot + 1);
+    }
+    out += '`';
+    for (char c : name) {
+        if (c == '`') out += '`';
+        out += c;
+    }
+    out += '`';
+}
+
+inline
+long long mysql::load_data(const std::string& table, const std::vector<std::string>& columns,
+                           std::function<bool(LoadWriter&)> produce)
+{
+    std::string q = "LOAD DATA LOCAL INFILE 'bulk_load' INTO TABLE ";
+    append_identifier(q, table);
+    Guard mg(*this);
+    revive();
+    if (!handle) return -1;
+    // the server would otherwise read the data in the database's character set
+    q += " CHARACTER SET ";
+    q += mysql_character_set_name(handle);
+    q += " FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n'";
+    if (!columns.empty()) {
+        q += " (";
+        for (size_t i = 0; i < columns.size(); i++) {
+            if (i) q += ", ";
+            append_identifier(q, columns[i]);
+        }
+        q += ')';
+    }
+    QueryTimer timer(observer, QueryKind::query, q);
+    LoadSource source{&produce, LoadWriter(), 0, true, 0};
+    mysql_set_local_infile_handler(handle, LoadSource::init, LoadSource::read, LoadSource::end, LoadSource::error,
+                                   &source);
+    int x = mysql_real_query(handle, q.c_str(), q.size());
+    mysql_set_local_infile_default(handle);
+    timer.lap(timer.stats.server);
+    timer.stats.bytes_sent = q.size() + source.sent;
+    if (x != 0) {
+        note_error(mysql_errno(handle));
+        if (timer) timer.fail(mysql_errno(handle), mysql_error(handle));
+        else std::cerr << "Error: " << mysql_error(handle) << "\n";
+        timer.finish();
+        return -1;
+    }
+    long long rows = (long long)mysql_affected_rows(handle);
+    timer.stats.rows = rows;
+    timer.finish();
+    // named as the reads that cached it were, by tables_of()
+    if (cache) cache->invalidate(tables_of(q));
+    return rows;
+}
+
+// Independent statements to run with one round trip via mysql::execute().
+class Batch {
+    private:
+        std::vector<std::string> statements;
+    public:
+        Batch& add(std::string s) {
+            while (!s.empty() && (s.back() == ';' || isspace((unsigned char)s.back()))) s.pop_back();
+            statements.push_back(std::move(s));
+            return *this;
+        }
+
+        size_t size() const {
+            return statements.size();
+        }
+
+        const std::string& operator[](size_t n) const {
+            return statements[n];
+        }
+
+        std::string text() const {
+            std::string q;
+            for (const std::string& s : statements) {
+                if (!q.empty()) q += ";\n";
+                q += s;
+            }
+            return q;
+        }
+};
+
+struct BatchResult {
+    // buffered rows of a SELECT-like statement, false otherwise
+    Result result;
+    long long affected_rows = 0;
+    // mysql_errno of the statement, 0 if it succeeded
+    unsigned int error = 0;
+    std::string message;
+    bool executed = false;
+};
+
+inline
+std::vector<BatchResult> mysql::execute(const Batch& batch)
+{
+    std::vector<BatchResult> results(batch.size());
+    if (batch.size() == 0) return results;
+    std::string q = batch.text();
+    QueryTimer timer(observer, QueryKind::query, q);
+    {
+        Guard mg(*this);
+        timer.lap(timer.stats.lock_wait);
+        revive();
+        run_batch(q, results, timer);
+    }
+    // even on error: a failing statement may have changed rows first
+    if (cache) {
+        bool use = false;
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (!is_read_only(batch[i])) cache->invalidate(tables_of(batch[i]));
+            use = use || uses_database(batch[i]);
+        }
+        if (use) {
+            Guard mg(*this);
+            reread_database(true);
+        }
+    }
+    return results;
+}
+
+inline
+void mysql::run_batch(const std::string& q, std::vector<BatchResult>& results, QueryTimer& timer)
+{
+    auto fail = [&](size_t i) {
+        results[i].executed = true;
+        results[i].error   = mysql_errno(handle);
+        results[i].message = mysql_error(handle);
+        note_error(results[i].error);
+        for (size_t j = i + 1; j < results.size(); j++) results[j].message = "not executed";
+        if (timer) timer.fail(results[i].error, results[i].message.c_str());
+        else std::cerr << "Error: statement " << i + 1 << " of batch: " << results[i].message << "\n";
+    };
+    // Stacked statements are allowed only for the batch: left on, every
+    // later query() could be given a second statement by injected text.
+    bool toggled = false;
+    if (!multi_statements) {
+        if (mysql_set_server_option(handle, MYSQL_OPTION_MULTI_STATEMENTS_ON)) {
+            fail(0);
+            results[0].executed = false;
+            timer.finish();
+            return;
+        }
+        toggled = true;
+    }
+    timer.stats.bytes_sent = q.size();
+    if (mysql_real_query(handle, q.c_str(), q.size())) {
+        timer.lap(timer.stats.server);
+        fail(0);
+    } else {
+        timer.lap(timer.stats.server);
+        for (size_t i = 0; ; i++) {
+            if (i < results.size()) {
+                BatchResult& r = results[i];
+                r.executed = true;
+                r.result   = store_result();
+                if (!r.result && mysql_field_count(handle) != 0) {
+                    fail(i);
+                    break;
+                }
+                r.affected_rows = (long long)mysql_affected_rows(handle);
+                timer.stats.rows += r.result ? r.result.num_rows() : (uint64_t)r.affected_rows;
+            } else if (MYSQL_RES* extra = mysql_store_result(handle)) {
+                // e.g. the status result of a CALL; not counted as a statement
+                mysql_free_result(extra);
+            }
+            int x = mysql_next_result(handle);
+            if (x < 0) break;
+            if (x > 0) {
+                if (i + 1 < results.size()) fail(i + 1);
+                break;
+            }
+        }
+        timer.lap(timer.stats.drain);
+    }
+    if (toggled) {
+        // anything still unread would put the option change out of sync
+        while (mysql_more_results(handle) && mysql_next_result(handle) == 0) {
+            if (MYSQL_RES* extra = mysql_store_result(handle)) mysql_free_result(extra);
+        }
+        if (mysql_set_server_option(handle, MYSQL_OPTION_MULTI_STATEMENTS_OFF)) {
+            note_error(mysql_errno(handle));
+            std::cerr << "Error: " << mysql_error(handle) << "\n";
+        }
+    }
+    timer.finish();
+}
+
+struct PoolOptions {
+    size_t min_size = 1;
+    size_t max_size = 8;
+    // how long acquire() waits for a connection when the pool is
+    // exhausted; failing to open a new one fails acquire() at once
+    std::chrono::milliseconds acquire_timeout = std::chrono::milliseconds(5000);
+    // idle connections above min_size are closed after this long
+    std::chrono::milliseconds idle_timeout = std::chrono::minutes(5);
+    // a connection is pinged on acquire only if it sat idle longer than this
+    std::chrono::milliseconds validate_after = std::chrono::seconds(30);
+    // if nonzero, a background thread pings connections that sat idle this
+    // long, so acquire() rarely has to and server timeouts don't hit them
+    std::chrono::milliseconds keepalive = std::chrono::milliseconds(0);
+    // set on every connection the pool opens, see mysql::set_observer
+    QueryObserver* observer = nullptr;
+    // shared by every connection the pool opens, see mysql::set_cache
+    ResultCache* cache = nullptr;
+    // transport settings of every connection the pool opens
+    ConnectOptions connect;
+    // On release a connection is rolled back, or fully reset with
+    // mysql_reset_connection if this is set, and dropped if that fails;
+    // see mysql::reset. A full reset also drops the statements
+    // warm_up() prepared.
+    bool reset_connection = false;
+};
+
+class ConnectionPool {
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct Idle {
+            std::unique_ptr<mysql> conn;
+            // returned to the pool, for eviction
+            clock::time_point since;
+            // last known to be alive, for validation
+            clock::time_point checked;
+        };
+
+    public:
+        class Lease {
+            private:
+                ConnectionPool* pool;
+                std::unique_ptr<mysql> conn;
+                bool broken;
+            public:
+                Lease() : pool(nullptr), broken(false) {}
+                Lease(ConnectionPool* pool, std::unique_ptr<mysql> conn)
+                    : pool(pool), conn(std::move(conn)), broken(false) {}
+
+                ~Lease() {
+                    release();
+                }
+
+                Lease(const Lease&) = delete;
+                Lease& operator=(const Lease&) = delete;
+
+                Lease(Lease&& x) noexcept : pool(x.pool), conn(std::move(x.conn)), broken(x.broken) {
+                    x.pool = nullptr;
+                }
+
+                Lease& operator=(Lease&& x) noexcept {
+                    if (this != &x) {
+                        release();
+                        pool   = x.pool;
+                        conn   = std::move(x.conn);
+                        broken = x.broken;
+                        x.pool = nullptr;
+                    }
+                    return *this;
+                }
+
+                operator bool() const {
+                    return !!conn;
+                }
+
+                mysql* operator->() const { return conn.get(); }
+                mysql& operator*() const { return *conn; }
+
+                // drop the connection instead of returning it to the pool,
+                // e.g. after the server went away mid-query
+                void discard() {
+                    broken = true;
+                }
+
+                void release() {
+                    if (pool && conn) pool->release(std::move(conn), broken);
+                    pool = nullptr;
+                }
+        };
+
+        ConnectionPool(
+                std::string host, std::string user, std::string password,
+                std::string db, unsigned int port, std::string unix_socket, unsigned long client_flag,
+                PoolOptions options = PoolOptions())
+            : host(std::move(host)), user(std::move(user)), password(std::move(password)),
+              db(std::move(db)), port(port), unix_socket(std::move(unix_socket)), client_flag(client_flag),
+              options(options), total(0), stopping(false) {
+            if (this->options.max_size == 0) this->options.max_size = 1;
+            if (this->options.min_size > this->options.max_size) this->options.min_size = this->options.max_size;
+            for (size_t i = 0; i < this->options.min_size; i++) {
+                std::unique_ptr<mysql> conn = open();
+                if (!conn) break;
+                idle.push_back(Idle{std::move(conn), clock::now(), clock::now()});
+                total++;
+            }
+            if (this->options.keepalive.count() > 0) keeper = std::thread([this] { keep_alive(); });
+        }
+
+        // every Lease must be released before the pool is destroyed; the
+        // destroying thread's local() lease is released here
+        ~ConnectionPool() {
+            release_local();
+            {
+                std::lock_guard<std::mutex> mg(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            if (keeper.joinable()) keeper.join();
+            std::lock_guard<std::mutex> mg(mutex);
+            idle.clear();
+        }
+
+        ConnectionPool(const ConnectionPool&) = delete;
+        ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+        // An idle connection, or a new one while fewer than max_size are
+        // open, else the first returned within acquire_timeout. Empty if
+        // none came in time or opening one failed; a server that refuses
+        // connections is not retried until the deadline.
+        Lease acquire() {
+            std::unique_lock<std::mutex> lk(mutex);
+            clock::time_point deadline = clock::now() + options.acquire_timeout;
+            for (;;) {
+                evict_expired(clock::now());
+                if (!idle.empty()) {
+                    // most recently used first, so surplus connections go cold and get evicted
+                    Idle entry = std::move(idle.back());
+                    idle.pop_back();
+                    lk.unlock();
+                    if (entry.conn->is_open()
+                        && (clock::now() - entry.checked < options.validate_after || entry.conn->ping())) {
+                        return Lease{this, std::move(entry.conn)};
+                    }
+                    entry.conn.reset();
+                    lk.lock();
+                    total--;
+                    continue;
+                }
+                if (total < options.max_size) {
+                    total++;
+                    lk.unlock();
+                    std::unique_ptr<mysql> conn = open();
+                    if (conn) return Lease{this, std::move(conn)};
+                    lk.lock();
+                    total--;
+                    available.notify_one();
+                    return Lease{};
+                }
+                // a broken connection given back while waiting frees a slot
+                if (available.wait_until(lk, deadline) == std::cv_status::timeout && idle.empty()
+                    && total >= options.max_size) {
+                    return Lease{};
+                }
+            }
+        }
+
+        // The connection leased to the calling thread, acquired on first use
+        // and kept until release_local() or the thread exits. It is bound to
+        // the thread (see mysql::bind_to_thread), so its calls take no lock.
+        // A connection found lost is replaced. nullptr if none could be
+        // acquired. Threads other than the one destroying the pool must
+        // release theirs, or have exited, before it is destroyed.
+        mysql* local() {
+            auto& leases = local_leases();
+            auto it = std::find_if(leases.begin(), leases.end(), [this](const LocalLease& x) {
+                return x.first == this;
+            });
+            if (it != leases.end()) {
+                if (it->second->is_open()) return &*it->second;
+                it->second.discard();
+                leases.erase(it);
+            }
+            Lease lease = acquire();
+            if (!lease) return nullptr;
+            lease->bind_to_thread();
+            leases.emplace_back(this, std::move(lease));
+            return &*leases.back().second;
+        }
+
+        // return the calling thread's local() connection to the pool
+        void release_local() {
+            auto& leases = local_leases();
+            auto it = std::find_if(leases.begin(), leases.end(), [this](const LocalLease& x) {
+                return x.first == this;
+            });
+            if (it != leases.end()) leases.erase(it);
+        }
+
+        // Open connections until n (at most max_size) are open, and prepare
+        // statements into the statement cache of every idle one, so the
+        // first requests pay for neither. Meant for startup: connections
+        // being warmed are not idle, and acquire() opens others meanwhile.
+        // Returns the number of idle connections.
+        size_t warm_up(size_t n, const std::vector<std::string>& statements = {}) {
+            std::vector<Idle> warm;
+            {
+                std::lock_guard<std::mutex> mg(mutex);
+                n = std::min(n, options.max_size);
+                if (!statements.empty()) {
+                    for (Idle& entry : idle) warm.push_back(std::move(entry));
+                    idle.clear();
+                }
+                size_t more = n > total ? n - total : 0;
+                for (size_t i = 0; i < more; i++) warm.push_back(Idle{nullptr, clock::now(), clock::now()});
+                total += more;
+            }
+            for (Idle& entry : warm) {
+                if (!entry.conn) entry.conn = open();
+                if (!entry.conn) continue;
+                for (const std::string& s : statements) entry.conn->prepare_cached(s);
+            }
+            std::lock_guard<std::mutex> mg(mutex);
+            for (Idle& entry : warm) {
+                if (!entry.conn) {
+                    total--;
+                    continue;
+                }
+                clock::time_point now = clock::now();
+                entry.since = entry.checked = now;
+                idle.push_back(std::move(entry));
+            }
+            available.notify_all();
+            return idle.size();
+        }
+
+        // close connections that sat idle past idle_timeout, keeping min_size open
+        void evict_idle() {
+            std::lock_guard<std::mutex> mg(mutex);
+            evict_expired(clock::now());
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> mg(mutex);
+            return total;
+        }
+
+        size_t idle_count() const {
+            std::lock_guard<std::mutex> mg(mutex);
+            return idle.size();
+        }
+
+    private:
+        std::string host;
+        std::string user;
+        std::string password;
+        std::string db;
+        unsigned int port;
+        std::string unix_socket;
+        unsigned long client_flag;
+        PoolOptions options;
+
+        std::deque<Idle> idle;
+        size_t total;
+        mutable std::mutex mutex;
+        std::condition_variable available;
+        std::thread keeper;
+        std::condition_variable wake;
+        bool stopping;
+
+        typedef std::pair<const ConnectionPool*, Lease> LocalLease;
+
+        // the calling thread's local() leases, one per pool; returned to
+        // their pools when the thread exits
+        static std::vector<LocalLease>& local_leases() {
+            static thread_local std::vector<LocalLease> leases;
+            return leases;
+        }
+
+        std::unique_ptr<mysql> open() {
+            std::unique_ptr<mysql> conn(new mysql());
+            conn->set_observer(options.observer);
+            conn->set_cache(options.cache);
+            if (!conn->connect(host.c_str(), user.c_str(), password.c_str(), db.c_str(), port,
+                               unix_socket.empty() ? nullptr : unix_socket.c_str(), client_flag, options.connect)) {
+                return nullptr;
+            }
+            return conn;
+        }
+
+        void release(std::unique_ptr<mysql> conn, bool broken) {
+            conn->unbind_thread();
+            // outside the lock, as it is a round trip
+            if (!broken) broken = !conn->reset(options.reset_connection);
+            {
+                std::lock_guard<std::mutex> mg(mutex);
+                if (broken) {
+                    total--;
+                } else {
+                    clock::time_point now = clock::now();
+                    idle.push_back(Idle{std::move(conn), now, now});
+                }
+            }
+            available.notify_one();
+        }
+
+        // Pings idle connections outside the lock, which is safe because
+        // nobody else holds them; dead ones are closed, and the rest go
+        // back in order of when they were returned.
+        void keep_alive() {
+            std::unique_lock<std::mutex> lk(mutex);
+            while (!stopping) {
+                wake.wait_for(lk, options.keepalive);
+                if (stopping) break;
+                clock::time_point now = clock::now();
+                evict_expired(now);
+                std::vector<Idle> due;
+                for (auto it = idle.begin(); it != idle.end();) {
+                    if (now - it->checked < options.keepalive) {
+                        ++it;
+                        continue;
+                    }
+                    due.push_back(std::move(*it));
+                    it = idle.erase(it);
+                }
+                if (due.empty()) continue;
+                lk.unlock();
+                for (Idle& entry : due) {
+                    if (entry.conn->ping()) entry.checked = clock::now();
+                    else entry.conn.reset();
+                }
+                lk.lock();
+                for (Idle& entry : due) {
+                    if (!entry.conn) {
+                        total--;
+                        continue;
+                    }
+                    auto at = std::upper_bound(idle.begin(), idle.end(), entry.since, [](clock::time_point t, const Idle& x) {
+                        return t < x.since;
+                    });
+                    idle.insert(at, std::move(entry));
+                }
+                available.notify_all();
+            }
+        }
+
+        // caller holds mutex; the oldest idle connections sit at the front
+        void evict_expired(clock::time_point now) {
+            while (!idle.empty() && total > options.min_size && now - idle.front().since > options.idle_timeout) {
+                idle.pop_front();
+                total--;
+            }
+        }
+};
+
+// where one server of a Cluster listens
+struct Endpoint {
+    std::string host;
+    unsigned int port = 0;
+    std::string unix_socket;
+};
+
+// How a Cluster picks a replica for a session: the one with the fewest
+// sessions reading from it, or that weighted by its moving average query
+// latency.
+enum class Balance { least_outstanding, latency };
+
+struct ClusterOptions {
+    // for the primary's pool and each replica's
+    PoolOptions pool;
+    Balance balance = Balance::least_outstanding;
+    // how long a session keeps reading from the primary after a write, so
+    // it sees its own writes despite replication lag; 0 for the rest of
+    // the session
+    std::chrono::milliseconds pin_for = std::chrono::milliseconds(0);
+};
+
+// A primary and its read replicas, each with a ConnectionPool. Work goes
+// through a Session, which sends writes and anything else that is not a
+// plain SELECT to the primary, and reads to one replica until it writes.
+class Cluster {
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct Replica {
+            std::unique_ptr<ConnectionPool> pool;
+            std::atomic<size_t> outstanding{0};
+            // moving average of query() latency in nanoseconds, 0 until measured
+            std::atomic<int64_t> latency{0};
+        };
+
+    public:
+        // Connections are taken from the pools as needed and held until the
+        // session ends; results and statements it hands out must not outlive
+        // it. Not for use by several threads at once.
+        class Session {
+            private:
+                Cluster* cluster;
+                ConnectionPool::Lease writer;
+                ConnectionPool::Lease reader;
+                // replica reader came from, or npos if none is leased
+                size_t replica;
+                bool wrote;
+                clock::time_point wrote_at;
+            public:
+                Session(Cluster* cluster) : cluster(cluster), replica(npos), wrote(false) {}
+
+                ~Session() {
+                    release();
+                }
+
+                Session(const Session&) = delete;
+                Session& operator=(const Session&) = delete;
+
+                Session(Session&& x) noexcept
+                    : cluster(x.cluster), writer(std::move(x.writer)), reader(std::move(x.reader)), replica(x.replica),
+                      wrote(x.wrote), wrote_at(x.wrote_at) {
+                    x.replica = npos;
+                }
+
+                Session& operator=(Session&& x) noexcept {
+                    if (this != &x) {
+                        release();
+                        cluster   = x.cluster;
+                        writer    = std::move(x.writer);
+                        reader    = std::move(x.reader);
+                        replica   = x.replica;
+                        wrote     = x.wrote;
+                        wrote_at  = x.wrote_at;
+                        x.replica = npos;
+                    }
+                    return *this;
+                }
+
+                Result query(std::string s, ResultMode mode = ResultMode::streaming) {
+                    bool read = is_read_only(s);
+                    mysql* conn = read ? reader_conn() : primary();
+                    if (!conn) {
+                        std::cerr << "Error: no connection available\n";
+                        return Result{};
+                    }
+                    if (!reader || conn != &*reader) return conn->query(std::move(s), mode);
+                    clock::time_point start = clock::now();
+                    Result result = conn->query(std::move(s), mode);
+                    cluster->record(replica, clock::now() - start);
+                    return result;
+                }
+
+                std::shared_ptr<const RowSet> query_cached(std::string s,
+                                                           std::chrono::milliseconds ttl = std::chrono::milliseconds(0)) {
+                    mysql* conn = is_read_only(s) ? reader_conn() : primary();
+                    if (!conn) {
+                        std::cerr << "Error: no connection available\n";
+                        return nullptr;
+                    }
+                    return conn->query_cached(std::move(s), ttl);
+                }
+
+                // Statements are routed by their SQL like query(); a read
+                // prepared before a write keeps reading from the replica.
+                Stmt prepare(std::string s) {
+                    mysql* conn = is_read_only(s) ? reader_conn() : primary();
+                    if (!conn) {
+                        std::cerr << "Error: no connection available\n";
+                        return Stmt{};
+                    }
+                    return conn->prepare(std::move(s));
+                }
+
+                // The primary's connection, for transactions and anything
+                // else query() can't tell is a write. Pins reads to it.
+                mysql* primary() {
+                    if (!writer) writer = cluster->primary->acquire();
+                    if (!writer) return nullptr;
+                    wrote    = true;
+                    wrote_at = clock::now();
+                    return &*writer;
+                }
+
+                // the connection reads go to now
+                mysql* reader_conn() {
+                    if (pinned()) return writer ? &*writer : primary();
+                    if (reader) return &*reader;
+                    for (size_t i : cluster->ranked()) {
+                        reader = cluster->replicas[i]->pool->acquire();
+                        if (!reader) continue;
+                        replica = i;
+                        cluster->replicas[i]->outstanding++;
+                        return &*reader;
+                    }
+                    // no replica reachable: read from the primary without pinning
+                    if (!writer) writer = cluster->primary->acquire();
+                    return writer ? &*writer : nullptr;
+                }
+
+                // whether reads go to the primary because of a recent write
+                bool pinned() const {
+                    return wrote && (cluster->options.pin_for.count() == 0
+                                     || clock::now() - wrote_at < cluster->options.pin_for);
+                }
+
+                // return the connections to their pools; the session can be used again
+                void release() {
+                    if (replica != npos) cluster->replicas[replica]->outstanding--;
+                    replica = npos;
+                    reader.release();
+                    writer.release();
+                    wrote = false;
+                }
+
+            private:
+                static constexpr size_t npos = ~(size_t)0;
+        };
+
+        Cluster(std::string user, std::string password, std::string db, unsigned long client_flag,
+                const Endpoint& primary, const std::vector<Endpoint>& replicas, ClusterOptions options = ClusterOptions())
+            : options(options), next(0) {
+            this->primary.reset(new ConnectionPool(primary.host, user, password, db, primary.port, primary.unix_socket,
+                                                   client_flag, options.pool));
+            for (const Endpoint& e : replicas) {
+                std::unique_ptr<Replica> r(new Replica());
+                r->pool.reset(new ConnectionPool(e.host, user, password, db, e.port, e.unix_socket, client_flag,
+                                                 options.pool));
+                this->replicas.push_back(std::move(r));
+            }
+        }
+
+        // every Session must end before the cluster is destroyed
+        Cluster(const Cluster&) = delete;
+        Cluster& operator=(const Cluster&) = delete;
+
+        Session session() {
+            return Session(this);
+        }
+
+        ConnectionPool& primary_pool() {
+            return *primary;
+        }
+
+        size_t replica_count() const {
+            return replicas.size();
+        }
+
+        ConnectionPool& replica_pool(size_t i) {
+            return *replicas[i]->pool;
+        }
+
+        // moving average query latency of replica i, zero until measured
+        std::chrono::nanoseconds replica_latency(size_t i) const {
+            return std::chrono::nanoseconds(replicas[i]->latency.load(std::memory_order_relaxed));
+        }
+
+    private:
+        ClusterOptions options;
+        std::unique_ptr<ConnectionPool> primary;
+        std::vector<std::unique_ptr<Replica>> replicas;
+        // rotates the starting point so ties are spread across replicas
+        std::atomic<size_t> next;
+
+        // replicas from most to least preferred
+        std::vector<size_t> ranked() {
+            size_t n = replicas.size();
+            std::vector<std::pair<uint64_t, size_t>> scores;
+            scores.reserve(n);
+            size_t start = n ? next.fetch_add(1, std::memory_order_relaxed) % n : 0;
+            for (size_t k = 0; k < n; k++) {
+                size_t i = (start + k) % n;
+                uint64_t load = replicas[i]->outstanding.load(std::memory_order_relaxed);
+                if (options.balance == Balance::latency) {
+                    load = (load + 1) * (uint64_t)(replicas[i]->latency.load(std::memory_order_relaxed) + 1);
+                }
+                scores.emplace_back(load, i);
+            }
+            std::stable_sort(scores.begin(), scores.end(),
+                             [](const std::pair<uint64_t, size_t>& a, const std::pair<uint64_t, size_t>& b) {
+                                 return a.first < b.first;
+                             });
+            std::vector<size_t> order;
+            order.reserve(n);
+            for (const auto& s : scores) order.push_back(s.second);
+            return order;
+        }
+
+        // fold one sample into replica i's average, weighted 1/8
+        void record(size_t i, clock::duration d) {
+            int64_t x = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+            std::atomic<int64_t>& avg = replicas[i]->latency;
+            int64_t old = avg.load(std::memory_order_relaxed);
+            while (!avg.compare_exchange_weak(old, old == 0 ? std::max<int64_t>(x, 1) : old + (x - old) / 8,
+                                              std::memory_order_relaxed)) {}
+        }
+};
+
+// An inclusive range of integer key values, one part of a parallel_scan()
+struct KeyRange {
+    long long lo;
+    long long hi;
+};
+
+struct ScanOptions {
+    // number of key ranges the scan is split into
+    size_t partitions = 8;
+    // connections used at once, each taking ranges in turn; 0 for one per range.
+    // A thread that gets no connection from the pool leaves its share to the
+    // others, and the scan fails only if none got one.
+    size_t threads = 0;
+};
+
+// Split min..max, inclusive, into at most n ranges of nearly equal width,
+// in order. Empty if n is 0 or max < min.
+inline
+std::vector<KeyRange> split_range(long long min, long long max, size_t n)
+{
+    std::vector<KeyRange> ranges;
+    if (n == 0 || max < min) return ranges;
+    // in unsigned arithmetic, where the count of values fits but for the
+    // full 64-bit range
+    unsigned long long count = (unsigned long long)max - (unsigned long long)min + 1;
+    if (count == 0) count = ~0ULL;
+    n = std::min<unsigned long long>(n, count);
+    unsigned long long size = count / n, extra = count % n;
+    unsigned long long lo = min;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long hi = i + 1 == n ? (unsigned long long)max : lo + size + (i < extra ? 1 : 0) - 1;
+        ranges.push_back(KeyRange{(long long)lo, (long long)hi});
+        lo = hi + 1;
+    }
+    return ranges;
+}
+
+// Split the values of integer column key of table, from its MIN to its
+// MAX, into at most n ranges of equal width. Empty if the table is;
+// nullopt if the query failed.
+inline
+std::optional<std::vector<KeyRange>> key_ranges(mysql& conn, const std::string& table, const std::string& key, size_t n)
+{
+    std::string q = "SELECT MIN(";
+    append_identifier(q, key);
+    q += "), MAX(";
+    append_identifier(q, key);
+    q += ") FROM ";
+    append_identifier(q, table);
+    Result r = conn.query(q, ResultMode::buffered);
+    if (!r) return std::nullopt;
+    Row row = r.fetch_row();
+    long long min, max;
+    if (!row || !row.get(0, min) || !row.get(1, max)) return std::vector<KeyRange>();
+    return split_range(min, max, n);
+}
+
+// Run sql once per key range of table, on connections from pool at the
+// same time. {lo} and {hi} in sql stand for the bounds of each range, as in
+// "SELECT ... FROM t WHERE id BETWEEN {lo} AND {hi}". consume(i, result) gets
+// the streaming result of range i on the thread that ran it, concurrently
+// with other ranges, and returns false to stop the scan. Returns false if a
+// leg failed or was stopped.
+template <class Consume>
+bool parallel_scan(ConnectionPool& pool, const std::string& table, const std::string& key, const std::string& sql,
+                   Consume consume, ScanOptions options = ScanOptions())
+{
+    std::vector<KeyRange> ranges;
+    {
+        ConnectionPool::Lease conn = pool.acquire();
+        if (!conn) {
+            std::cerr << "Error: no connection available\n";
+            return false;
+        }
+        std::optional<std::vector<KeyRange>> found = key_ranges(*conn, table, key, options.partitions);
+        if (!found) return false;
+        ranges = std::move(*found);
+    }
+    size_t threads = options.threads ? std::min(options.threads, ranges.size()) : ranges.size();
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::atomic<bool> acquired(false);
+    auto work = [&]() {
+        ConnectionPool::Lease conn = pool.acquire();
+        if (!conn) return;
+        acquired = true;
+        for (size_t i = next++; i < ranges.size() && !failed; i = next++) {
+            std::string q = sql;
+            for (auto [name, value] : {std::make_pair("{lo}", ranges[i].lo), std::make_pair("{hi}", ranges[i].hi)}) {
+                std::string v = std::to_string(value);
+                for (size_t at = q.find(name); at != std::string::npos; at = q.find(name, at + v.size())) {
+                    q.replace(at, 4, v);
+                }
+            }
+            Result result = conn->query(std::move(q));
+            if (!result || !consume(i, result)) {
+                failed = true;
+                break;
+            }
+            // a streaming result that broke off leaves the error behind
+            result = Result{};
+            if (mysql_errno(conn->native_handle())) {
+                std::cerr << "Error: " << mysql_error(conn->native_handle()) << "\n";
+                failed = true;
+                break;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++) workers.emplace_back(work);
+    if (threads) work();
+    for (std::thread& t : workers) t.join();
+    if (threads && !acquired) {
+        std::cerr << "Error: no connection available\n";
+        return false;
+    }
+    return !failed;
+}
+
+// the rows of a parallel_scan() merged in key range order, or an empty set on error
+inline
+RowSet parallel_fetch(ConnectionPool& pool, const std::string& table, const std::string& key, const std::string& sql,
+                      ScanOptions options = ScanOptions())
+{
+    std::vector<RowSet> parts(std::max<size_t>(options.partitions, 1));
+    bool ok = parallel_scan(pool, table, key, sql, [&](size_t i, Result& result) {
+        parts[i] = result.fetch_all();
+        return true;
+    }, options);
+    RowSet rows;
+    if (!ok) return rows;
+    for (RowSet& part : parts) rows.splice(std::move(part));
+    return rows;
+}
+
+// What a pending AsyncOp waits for; the same bits as MariaDB's MYSQL_WAIT_*.
+enum {
+    async_read    = 1,
+    async_write   = 2,
+    async_except  = 4,
+    async_timeout = 8
+};
+
+enum class AsyncStatus { pending, done, failed };
+
+// One nonblocking client call. start() it, then resume() with the ready
+// events whenever fd() becomes ready for events(), until it is no longer
+// pending. Built on MariaDB's _start/_cont functions or MySQL 8's
+// *_nonblocking ones; with other clients every operation completes
+// synchronously inside start().
+class AsyncOp {
+    public:
+        AsyncOp(MYSQL* handle) : handle(handle), wait(0), ok(false) {}
+        virtual ~AsyncOp() {}
+
+        AsyncOp(const AsyncOp&) = delete;
+        AsyncOp& operator=(const AsyncOp&) = delete;
+
+        AsyncStatus start() {
+            return settle(begin());
+        }
+
+        AsyncStatus resume(int ready) {
+            return settle(cont(ready));
+        }
+
+        int events() const {
+            return wait;
+        }
+
+        int fd() const {
+            return handle ? (int)mysql_get_socket(handle) : -1;
+        }
+
+        // how long to wait before resuming with async_timeout, if events() has it
+        unsigned int timeout_ms() const {
+#if MYSQL_HPP_ASYNC_MARIADB
+            return (wait & async_timeout) ? mysql_get_timeout_value_ms(handle) : 0;
+#else
+            return 0;
+#endif
+        }
+
+        virtual const char* error() const {
+            return handle ? mysql_error(handle) : "no connection";
+        }
+
+    protected:
+        MYSQL* handle;
+        int wait;
+        bool ok;
+
+        // both return the events to wait for, or 0 once finished with ok set
+        virtual int begin() = 0;
+        virtual int cont(int ready) = 0;
+
+#if MYSQL_HPP_ASYNC_MYSQL
+        int net_status(net_async_status status, int events = async_read) {
+            if (status == NET_ASYNC_NOT_READY) return events;
+            ok = status != NET_ASYNC_ERROR;
+            return 0;
+        }
+#endif
+
+        static const char* c_str(const std::string& s) {
+            return s.empty() ? nullptr : s.c_str();
+        }
+
+    private:
+        AsyncStatus settle(int w) {
+            wait = w;
+            if (w) return AsyncStatus::pending;
+            return ok ? AsyncStatus::done : AsyncStatus::failed;
+        }
+};
+
+class AsyncConnect : public AsyncOp {
+    private:
+        std::string host;
+        std::string user;
+        std::string password;
+        std::string db;
+        unsigned int port;
+        std::string unix_socket;
+        unsigned long client_flag;
+        MYSQL* ret;
+        // told once connected, see mysql::connected
+        mysql* conn;
+    public:
+        AsyncConnect(
+                MYSQL* handle, std::string host, std::string user, std::string password,
+                std::string db, unsigned int port, std::string unix_socket, unsigned long client_flag,
+                mysql* conn = nullptr)
+            : AsyncOp(handle), host(std::move(host)), user(std::move(user)), password(std::move(password)),
+              db(std::move(db)), port(port), unix_socket(std::move(unix_socket)), client_flag(client_flag),
+              ret(nullptr), conn(conn) {}
 
-class mysql;
-class Stmt;
-class Result;
+    protected:
+        int begin() override {
+            if (!handle) return 0;
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_real_connect_start(&ret, handle, c_str(host), c_str(user), c_str(password),
+                                             c_str(db), port, c_str(unix_socket), client_flag);
+            return w ? w : connected();
+#elif MYSQL_HPP_ASYNC_MYSQL
+            return cont(0);
+#else
+            ret = mysql_real_connect(handle, c_str(host), c_str(user), c_str(password),
+                                     c_str(db), port, c_str(unix_socket), client_flag);
+            return connected();
+#endif
+        }
 
-std::string escape_string(std::string val) {
-    std::string result = "";
-    size_t pev = -1;
-    for(size_t i = 0; i < val.length(); ++i) {
-        pev = i - 1;
-        switch(val.at(i)) {
-            case '\'': case '\n' : case '\r': case '\t': case '\v': case '\f': case '\\': case '"': {
-                if(pev >= 0) {
-                    if (val.at(pev) != '\\') { result.append(1, '\\'); }
-                } else {
-                    result.append(1, '\\');
-                }
-                if (val.at(i) == '\n') { result += "\\n"; }
-                else if (val.at(i) == '\r') { result += "\\r"; }
-                else if (val.at(i) == '\t') { result += "\\t"; }
-                else if (val.at(i) == '\f') { result += "\\f"; }
-                else if (val.at(i) == '\v') { result += "\\v"; }
-                else { result.append(1, val.at(i)); }
-            } break;
-            default: result.append(1, val.at(i)); break;
+        int cont(int ready) override {
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_real_connect_cont(&ret, handle, ready);
+            return w ? w : connected();
+#elif MYSQL_HPP_ASYNC_MYSQL
+            (void)ready;
+            // the handshake gives no hint which direction it is blocked on
+            int w = net_status(mysql_real_connect_nonblocking(handle, c_str(host), c_str(user), c_str(password),
+                                                              c_str(db), port, c_str(unix_socket), client_flag),
+                               async_read | async_write);
+            if (!w && ok && conn) conn->async_connected(handle, client_flag);
+            return w;
+#else
+            (void)ready;
+            return 0;
+#endif
         }
-    }
-    return result;
-}
 
-class mysql {
+    private:
+        int connected() {
+            ok = ret != nullptr;
+            if (ok && conn) conn->async_connected(handle, client_flag);
+            return 0;
+        }
+};
+
+class AsyncQuery : public AsyncOp {
+    private:
+        std::string sql;
+        ResultMode mode;
+        int phase;
+        int err;
+        MYSQL_RES* res;
+        std::shared_ptr<std::atomic<bool>> alive;
     public:
-        mysql() : handle(mysql_init(0)) {}
+        // alive, when given, is cleared if the connection turns out lost
+        AsyncQuery(MYSQL* handle, std::string sql, ResultMode mode = ResultMode::buffered,
+                   std::shared_ptr<std::atomic<bool>> alive = nullptr)
+            : AsyncOp(handle), sql(std::move(sql)), mode(mode), phase(0), err(0), res(nullptr),
+              alive(std::move(alive)) {}
 
-        ~mysql() {
-            close();
+        ~AsyncQuery() {
+            if (res) mysql_free_result(res);
         }
 
-        bool connect(
-                const char* host, const char* user, const char* password,
-                const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag) {
-            if (is_open()) close();
-            std::lock_guard<std::mutex> mg(mutex);
-            handle = mysql_init(nullptr);
-            if (handle == nullptr) return false;
-            MYSQL* h = mysql_real_connect(handle, host, user, password,
-                                          db, port, unix_socket, client_flag);
-            if (h) return true;
-            std::cerr << "Failed to connect to database: Error: " << mysql_error(handle) << "\n";
-            mysql_close(handle);
-            handle = nullptr;
-            return false;
-        }
-        void close() {
-            std::lock_guard<std::mutex> mg(mutex);
-            if (handle != nullptr) {
-                mysql_close(handle);
-                handle = nullptr;
-            }
+        // The result once done. A statement without a result set gives a
+        // false Result; a streaming one is read further with AsyncFetch.
+        Result take_result() {
+            MYSQL_RES* r = res;
+            res = nullptr;
+            if (!r) return Result{};
+            return Result{r, mode == ResultMode::buffered};
         }
-        bool is_open() const {
-            if(handle == nullptr) return false;
-            std::lock_guard<std::mutex> mg(mutex);
-            return mysql_ping(handle) == 0;
+
+    protected:
+        int begin() override {
+            phase = 0;
+            if (!handle) return 0;
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_real_query_start(&err, handle, sql.c_str(), sql.size());
+            return w ? w : sent();
+#elif MYSQL_HPP_ASYNC_MYSQL
+            return cont(0);
+#else
+            err = mysql_real_query(handle, sql.c_str(), sql.size());
+            sent();
+            if (phase != 1) return 0;
+            res = mysql_store_result(handle);
+            return stored();
+#endif
         }
-        Stmt   prepare(std::string s);
-        Result query(std::string s);
-        inline
-        int insert_id() {
-            if(handle) {
-                return mysql_insert_id(handle);
+
+        int cont(int ready) override {
+#if MYSQL_HPP_ASYNC_MARIADB
+            if (phase == 0) {
+                int w = mysql_real_query_cont(&err, handle, ready);
+                return w ? w : sent();
             }
-            return -1;
+            int w = mysql_store_result_cont(&res, handle, ready);
+            return w ? w : stored();
+#elif MYSQL_HPP_ASYNC_MYSQL
+            (void)ready;
+            if (phase == 0) {
+                net_async_status s = mysql_real_query_nonblocking(handle, sql.c_str(), sql.size());
+                if (s == NET_ASYNC_NOT_READY) return async_read;
+                err = s == NET_ASYNC_ERROR;
+                sent();
+                // the result may already sit in the client buffer, so try
+                // reading it before waiting on the socket
+                if (phase != 1) return 0;
+            }
+            net_async_status s = mysql_store_result_nonblocking(handle, &res);
+            if (s == NET_ASYNC_NOT_READY) return async_read;
+            return stored();
+#else
+            (void)ready;
+            return 0;
+#endif
         }
-        inline
-        int affected_rows() {
-            if (handle) {
-                return mysql_affected_rows(handle);
+
+    private:
+        // Query is on the server; a streaming result needs no further I/O
+        // here, a buffered one moves to phase 1. Returns events to wait for.
+        int sent() {
+            if (err) {
+                ok = false;
+                lost();
+                return 0;
             }
-            return -1;
+            if (mode == ResultMode::streaming) {
+                res = mysql_use_result(handle);
+                return stored();
+            }
+            phase = 1;
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_store_result_start(&res, handle);
+            return w ? w : stored();
+#else
+            return 0;
+#endif
         }
-        inline
-        int more_results() {
-            return mysql_more_results(handle);
+
+        int stored() {
+            phase = 2;
+            ok = res != nullptr || mysql_errno(handle) == 0;
+            if (!ok) lost();
+            return 0;
         }
 
-        inline int next_result();
-        inline Result use_result();
-    private:
-        MYSQL* handle;
-        mutable std::mutex mutex;
+        void lost() {
+            if (alive && connection_lost(mysql_errno(handle))) *alive = false;
+        }
 };
 
-class Stmt {
+// Reads the next row of a streaming Result; start() it again for every row.
+class AsyncFetch : public AsyncOp {
     private:
-        MYSQL_STMT* stmt;
-        size_t count;
-        MYSQL_BIND* params;
-        long unsigned int str_length;
+        MYSQL_RES* res;
+        MYSQL_ROW current;
+        std::shared_ptr<std::atomic<bool>> alive;
     public:
-        Stmt() : stmt(0), count(0), params(0) {}
-        Stmt(MYSQL_STMT* stmt)
-            : stmt(stmt), count(mysql_stmt_param_count(stmt)), params(new MYSQL_BIND[count]) {
-            memset(params, 0, sizeof(MYSQL_BIND[count]));
-        }
+        // alive, when given, is cleared if the connection turns out lost
+        AsyncFetch(MYSQL* handle, Result& result, std::shared_ptr<std::atomic<bool>> alive = nullptr)
+            : AsyncOp(handle), res(result.native_handle()), current(nullptr), alive(std::move(alive)) {}
 
-        ~Stmt() {
-            if (stmt) mysql_stmt_close(stmt);
-            delete [] params;
+        // the fetched row, false at the end of the result
+        Row row() const {
+            return Row{current, current ? mysql_fetch_lengths(res) : nullptr};
         }
 
-        Stmt(const Stmt&) = delete;
-        Stmt& operator=(const Stmt&) = delete;
-
-        Stmt(Stmt&& x) : stmt(x.stmt), count(x.count), params(x.params), str_length(x.str_length) {
-            x.stmt = 0;
-            x.params = nullptr;
+    protected:
+        int begin() override {
+            current = nullptr;
+            if (!res) return fetched();
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_fetch_row_start(&current, res);
+            return w ? w : fetched();
+#elif MYSQL_HPP_ASYNC_MYSQL
+            return cont(0);
+#else
+            current = mysql_fetch_row(res);
+            return fetched();
+#endif
         }
 
-        Stmt& operator=(Stmt&& x) {
-            stmt   = x.stmt;
-            count  = x.count;
-            params = x.params;
-            str_length = x.str_length;
-            x.stmt   = 0;
-            x.params = nullptr;
-            return *this;
+        int cont(int ready) override {
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_fetch_row_cont(&current, res, ready);
+            return w ? w : fetched();
+#elif MYSQL_HPP_ASYNC_MYSQL
+            (void)ready;
+            net_async_status s = mysql_fetch_row_nonblocking(res, &current);
+            if (s == NET_ASYNC_NOT_READY) return async_read;
+            return fetched();
+#else
+            (void)ready;
+            return 0;
+#endif
         }
 
-        operator bool() {
-            return !!stmt;
+    private:
+        int fetched() {
+            ok = current != nullptr || !handle || mysql_errno(handle) == 0;
+            if (!ok && alive && connection_lost(mysql_errno(handle))) *alive = false;
+            return 0;
         }
+};
 
+// Prepares a statement. MySQL has no nonblocking prepare, so there (and on
+// older clients) it completes synchronously inside start().
+class AsyncPrepare : public AsyncOp {
+    private:
+        std::string sql;
+        MYSQL_STMT* stmt;
+        int err;
+        QueryObserver* observer;
+        std::shared_ptr<std::atomic<bool>> alive;
+        ResultCache* cache;
+        const ThreadOwner* owner;
+        std::string database;
+        const std::string* session;
+    public:
+        // the rest is handed on to the Stmt, as mysql::prepare() does
+        AsyncPrepare(MYSQL* handle, std::string sql, QueryObserver* observer = nullptr,
+                     std::shared_ptr<std::atomic<bool>> alive = nullptr,
+                     ResultCache* cache = nullptr, const ThreadOwner* owner = nullptr,
+                     std::string database = std::string(), const std::string* session = nullptr)
+            : AsyncOp(handle), sql(std::move(sql)), stmt(nullptr), err(0),
+              observer(observer), alive(std::move(alive)), cache(cache), owner(owner),
+              database(std::move(database)), session(session) {}
 
-        void bind_param(int i, enum_field_types buffer_type, void* buffer, int buffer_length, my_bool* is_null, long unsigned int* length) {
-            MYSQL_BIND& b   = params[i];
-            b.buffer_type   = buffer_type;
-            b.buffer        = (char*)buffer;
-            b.buffer_length = buffer_length;
-            b.is_null       = is_null;
-            b.length        = length;
+        ~AsyncPrepare() {
+            if (stmt) mysql_stmt_close(stmt);
         }
 
-        inline
-        void bind_param(int i, const int& x) {
-            bind_param(i, MYSQL_TYPE_LONG, (char*)&x, 0, 0, 0);
+        Stmt take_stmt() {
+            if (!ok || !stmt) return Stmt{};
+            MYSQL_STMT* s = stmt;
+            stmt = nullptr;
+            return Stmt{handle, s, sql, observer, alive, cache, owner, database, session};
         }
 
-        inline
-        void bind_param(int i, const std::string& x) {
-            bind_param(i, MYSQL_TYPE_STRING, (char*)x.c_str(), x.size(), 0, &(params[i].buffer_length));
+        const char* error() const override {
+            return stmt ? mysql_stmt_error(stmt) : AsyncOp::error();
         }
 
-        template <class... Types>
-        inline
-        void execute(Types ... args) {
-            _execute(0, args...);
-            mysql_stmt_bind_param(stmt, params);
-            mysql_stmt_execute(stmt);
+    protected:
+        int begin() override {
+            if (stmt) mysql_stmt_close(stmt);
+            stmt = handle ? mysql_stmt_init(handle) : nullptr;
+            if (!stmt) return prepared();
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_stmt_prepare_start(&err, stmt, sql.c_str(), sql.size());
+            return w ? w : prepared();
+#else
+            err = mysql_stmt_prepare(stmt, sql.c_str(), sql.size());
+            return prepared();
+#endif
         }
 
-        template <class T, class... Types>
-        inline
-        void _execute(int n, const T& x, Types ... args) {
-            bind_param(n, x);
-            _execute(n+1, args...);
+        int cont(int ready) override {
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_stmt_prepare_cont(&err, stmt, ready);
+            return w ? w : prepared();
+#else
+            (void)ready;
+            return 0;
+#endif
         }
 
-        // base case
-        inline
-        void _execute(int n) {}
+    private:
+        int prepared() {
+            ok = stmt != nullptr && err == 0;
+            if (!ok && alive && connection_lost(stmt ? mysql_stmt_errno(stmt) : mysql_errno(handle)))
+                *alive = false;
+            return 0;
+        }
 };
 
-class Row {
+// Executes a Stmt with the parameters last given to Stmt::bind(). Like
+// AsyncPrepare this is only truly nonblocking with MariaDB. Errors, the
+// observer and the cache are seen to as by Stmt::execute().
+class AsyncExecute : public AsyncOp {
     private:
-        MYSQL_ROW row;
-        unsigned long *lengths;
+        MYSQL_STMT* stmt;
+        int err;
+        Stmt* source;
+        bool bound;
+        QueryTimer timer;
     public:
-        Row() : row(nullptr), lengths(nullptr) {}
-        Row(MYSQL_ROW row, unsigned long* lengths) : row(row), lengths(lengths) {}
+        // Fails without executing when not ready (the checks of
+        // Stmt::execute() failed) or not bound (Stmt::bind() failed).
+        AsyncExecute(MYSQL* handle, Stmt& stmt, bool ready = true, bool bound = true)
+            : AsyncOp(handle), stmt(ready ? stmt.native_handle() : nullptr), err(0), source(&stmt),
+              bound(bound), timer(stmt.observer, QueryKind::execute, stmt.sql) {}
 
-        Row(Row&& x) : row(x.row), lengths(x.lengths) {
-            x.row     = nullptr;
-            x.lengths = nullptr;
+        const char* error() const override {
+            return stmt ? mysql_stmt_error(stmt) : AsyncOp::error();
         }
 
-        Row& operator=(Row&& x) {
-            using std::swap;
-            swap(*this, x);
-            return *this;
+    protected:
+        int begin() override {
+            if (!stmt || !bound) return executed();
+            timer.lap(timer.stats.send);
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_stmt_execute_start(&err, stmt);
+            return w ? w : executed();
+#else
+            err = mysql_stmt_execute(stmt);
+            return executed();
+#endif
         }
 
-        operator bool() {
-            return !!row;
+        int cont(int ready) override {
+#if MYSQL_HPP_ASYNC_MARIADB
+            int w = mysql_stmt_execute_cont(&err, stmt, ready);
+            return w ? w : executed();
+#else
+            (void)ready;
+            return 0;
+#endif
         }
 
-        std::string operator[](size_t n) {
-            return std::string(row[n], lengths[n]);
+    private:
+        int executed() {
+            ok = false;
+            if (!stmt) return 0;
+            if (bound) timer.lap(timer.stats.server);
+            ok = source->account_execute(timer, bound && err == 0, source->params);
+            return 0;
         }
 };
 
-class Result {
+inline
+AsyncConnect mysql::connect_async(
+        std::string host, std::string user, std::string password,
+        std::string db, unsigned int port, std::string unix_socket, unsigned long client_flag,
+        const ConnectOptions& options)
+{
+    Guard mg(*this);
+    client_flag = start_connect(Target{std::move(host), std::move(user), std::move(password), std::move(db),
+                                       port, std::move(unix_socket), client_flag, options});
+    const Target& t = *target;
+    return AsyncConnect(handle, t.host, t.user, t.password, t.db, t.port, t.unix_socket, client_flag, this);
+}
+
+inline
+AsyncQuery mysql::query_async(std::string s, ResultMode mode)
+{
+    Guard mg(*this);
+    return AsyncQuery(handle, std::move(s), mode, alive);
+}
+
+inline
+AsyncFetch mysql::fetch_async(Result& result)
+{
+    Guard mg(*this);
+    return AsyncFetch(handle, result, alive);
+}
+
+#ifdef __linux__
+// Drives many AsyncOps, at most one per connection, from a single thread
+// with epoll.
+class EventLoop {
     private:
-        MYSQL_RES* res;
-        int num_fields;
+        typedef std::chrono::steady_clock clock;
+
+        struct Pending {
+            AsyncOp* op;
+            std::function<void(AsyncStatus)> done;
+            bool timed;
+            clock::time_point deadline;
+        };
+
+        int epfd;
+        std::unordered_map<int, Pending> pending;
+
     public:
-        Result() : res(0), num_fields(0) {}
-        Result(MYSQL_RES* res) : res(res), num_fields(mysql_num_fields(res)) {}
-        Result(Result&& r) {
-            res = r.res;
-            r.res = 0;
+        EventLoop() : epfd(epoll_create1(EPOLL_CLOEXEC)) {}
 
-            num_fields = r.num_fields;
+        ~EventLoop() {
+            if (epfd >= 0) ::close(epfd);
         }
 
-        ~Result() {
-            if (res) mysql_free_result(res);
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        // Start op and call done with its outcome once it finishes, which may
+        // happen before submit() returns. op must stay alive until then.
+        void submit(AsyncOp& op, std::function<void(AsyncStatus)> done) {
+            AsyncStatus status = op.start();
+            if (status != AsyncStatus::pending) {
+                done(status);
+                return;
+            }
+            watch(op, std::move(done));
         }
 
-        operator bool() {
-            return !!res;
+        // like submit() for an op already started and still pending
+        void watch(AsyncOp& op, std::function<void(AsyncStatus)> done) {
+            int fd = op.fd();
+            if (fd < 0 || pending.count(fd)) {
+                done(AsyncStatus::failed);
+                return;
+            }
+            Pending& p = pending[fd];
+            p.op   = &op;
+            p.done = std::move(done);
+            arm(fd, p, EPOLL_CTL_ADD);
         }
 
-        Result& operator=(Result&& r) {
-            mysql_free_result(res);
-            res = r.res;
-            num_fields = r.num_fields;
-            r.res = 0;
-            return *this;
+        size_t size() const {
+            return pending.size();
         }
 
-        Result& operator=(const Result&) = delete;
-        Result(const Result&) = delete;
-        std::map<std::string,std::string> fetch_array() {
-            Row row = fetch_row();
-            if (!row) return {};
-            std::vector<std::string> keys;
-            MYSQL_FIELD *fields = mysql_fetch_fields(res);
-            for(int i = 0; i < num_fields; i++) {
-                keys.push_back(std::string(fields[i].name));
+        // run until every submitted operation has finished
+        void run() {
+            while (!pending.empty()) poll(-1);
+        }
+
+        // Wait up to timeout_ms (-1 for no limit) for I/O or timeouts and
+        // advance the operations concerned. Returns how many are still pending.
+        size_t poll(int timeout_ms) {
+            if (pending.empty()) return 0;
+            clock::time_point now = clock::now();
+            for (const auto& e : pending) {
+                if (!e.second.timed) continue;
+                long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(e.second.deadline - now).count();
+                if (ms < 0) ms = 0;
+                if (timeout_ms < 0 || ms < timeout_ms) timeout_ms = (int)ms;
             }
-            std::map<std::string, std::string> data;
-            for(int i = 0; i < num_fields; i++) {
-                data[keys[i]] = row[i];
+            epoll_event events[64];
+            int n = epoll_wait(epfd, events, 64, timeout_ms);
+            for (int i = 0; i < n; i++) {
+                int ready = 0;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ready |= async_read;
+                if (events[i].events & EPOLLOUT) ready |= async_write;
+                if (events[i].events & EPOLLPRI) ready |= async_except;
+                advance(events[i].data.fd, ready);
             }
-            return data;
+            now = clock::now();
+            std::vector<int> expired;
+            for (const auto& e : pending) {
+                if (e.second.timed && e.second.deadline <= now) expired.push_back(e.first);
+            }
+            for (int fd : expired) advance(fd, async_timeout);
+            return pending.size();
         }
-        Row fetch_row() {
-            MYSQL_ROW row = mysql_fetch_row(res);
-            unsigned long* lengths = mysql_fetch_lengths(res);
-            return Row{row, lengths};
+
+    private:
+        void arm(int fd, Pending& p, int how) {
+            int wait = p.op->events();
+            epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.data.fd = fd;
+            if (wait & async_read) ev.events |= EPOLLIN;
+            if (wait & async_write) ev.events |= EPOLLOUT;
+            if (wait & async_except) ev.events |= EPOLLPRI;
+            epoll_ctl(epfd, how, fd, &ev);
+            p.timed = (wait & async_timeout) != 0;
+            if (p.timed) p.deadline = clock::now() + std::chrono::milliseconds(p.op->timeout_ms());
         }
 
-        inline
-        Row next() {
-            return fetch_row();
+        void advance(int fd, int ready) {
+            auto it = pending.find(fd);
+            if (it == pending.end()) return;
+            AsyncStatus status = it->second.op->resume(ready);
+            if (status == AsyncStatus::pending) {
+                arm(fd, it->second, EPOLL_CTL_MOD);
+                return;
+            }
+            std::function<void(AsyncStatus)> done = std::move(it->second.done);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+            pending.erase(it);
+            done(status);
         }
-        inline
-        std::map<std::string,std::string> next_array() {
-            return fetch_array();
+};
+#endif
+
+#if MYSQL_HPP_COROUTINES
+inline bool await_take(AsyncConnect&, AsyncStatus status) {
+    return status == AsyncStatus::done;
+}
+
+inline Result await_take(AsyncQuery& op, AsyncStatus status) {
+    if (status != AsyncStatus::done) {
+        std::cerr << "Error: " << op.error() << "\n";
+        return Result{};
+    }
+    return op.take_result();
+}
+
+inline Row await_take(AsyncFetch& op, AsyncStatus status) {
+    if (status != AsyncStatus::done) return Row{};
+    return op.row();
+}
+
+inline Stmt await_take(AsyncPrepare& op, AsyncStatus status) {
+    if (status != AsyncStatus::done) return Stmt{};
+    return op.take_stmt();
+}
+
+// the error was reported by the op, as Stmt::execute() does
+inline bool await_take(AsyncExecute&, AsyncStatus status) {
+    return status == AsyncStatus::done;
+}
+
+// Runs an AsyncOp when co_awaited: the coroutine is suspended while the op
+// is pending and resumed from EventLoop::poll() once it finishes.
+template <class Op>
+class Awaitable {
+    protected:
+        EventLoop* loop;
+        Op op;
+        AsyncStatus status;
+    public:
+        template <class... Args>
+        Awaitable(EventLoop& loop, Args&& ... args)
+            : loop(&loop), op(std::forward<Args>(args)...), status(AsyncStatus::pending) {}
+
+        bool await_ready() {
+            status = op.start();
+            return status != AsyncStatus::pending;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            loop->watch(op, [this, h](AsyncStatus s) {
+                status = s;
+                h.resume();
+            });
+        }
+
+        auto await_resume() {
+            return await_take(op, status);
+        }
+};
+
+// Rows of a streaming result read without blocking, one co_await per row.
+class RowStream {
+    private:
+        EventLoop* loop;
+        MYSQL* handle;
+        Result result;
+        // of the connection as it was when queried, which a reconnect replaces
+        std::shared_ptr<std::atomic<bool>> alive;
+    public:
+        RowStream(EventLoop& loop, MYSQL* handle, Result&& result,
+                  std::shared_ptr<std::atomic<bool>> alive = nullptr)
+            : loop(&loop), handle(handle), result(std::move(result)), alive(std::move(alive)) {}
+
+        explicit operator bool() {
+            return !!result;
+        }
+
+        // yields a false Row at the end of the result
+        Awaitable<AsyncFetch> next() {
+            return Awaitable<AsyncFetch>(*loop, handle, result, alive);
+        }
+};
+
+class StreamAwaitable : public Awaitable<AsyncQuery> {
+    private:
+        MYSQL* handle;
+        std::shared_ptr<std::atomic<bool>> alive;
+    public:
+        StreamAwaitable(EventLoop& loop, MYSQL* handle, std::string s,
+                        std::shared_ptr<std::atomic<bool>> alive = nullptr)
+            : Awaitable<AsyncQuery>(loop, handle, std::move(s), ResultMode::streaming, alive),
+              handle(handle), alive(std::move(alive)) {}
+
+        RowStream await_resume() {
+            return RowStream(*loop, handle, await_take(op, status), alive);
         }
 };
 
+template <class... Types>
 inline
-Result mysql::use_result()
+Awaitable<AsyncExecute> Stmt::execute(EventLoop& loop, const Types& ... args)
 {
-    MYSQL_RES* result = mysql_use_result(handle);
-    if (!result) {
-        Result{};
-    }
-    return Result{result};
+    bool ready = can_execute(sizeof...(Types));
+    bool bound = ready && bind(args...);
+    // a stale statement's connection handle may be gone
+    return Awaitable<AsyncExecute>(loop, ready ? conn : nullptr, *this, ready, bound);
 }
 
 inline
-int mysql::next_result()
+Awaitable<AsyncConnect> mysql::connect(
+        EventLoop& loop, std::string host, std::string user, std::string password,
+        std::string db, unsigned int port, std::string unix_socket, unsigned long client_flag,
+        const ConnectOptions& options)
 {
-    int x = mysql_next_result(handle);
-    return x;
+    Guard mg(*this);
+    client_flag = start_connect(Target{std::move(host), std::move(user), std::move(password), std::move(db),
+                                       port, std::move(unix_socket), client_flag, options});
+    const Target& t = *target;
+    return Awaitable<AsyncConnect>(loop, handle, t.host, t.user, t.password, t.db, t.port, t.unix_socket,
+                                   client_flag, this);
 }
 
-Stmt mysql::prepare(std::string s) {
-    std::lock_guard<std::mutex> mg(mutex);
-    MYSQL_STMT* stmt = mysql_stmt_init(handle);
-    int x = mysql_stmt_prepare(stmt, s.c_str(), s.size());
-    if (x != 0) {
-        return Stmt{};
-    }
-    return Stmt{stmt};
+inline
+Awaitable<AsyncQuery> mysql::query(EventLoop& loop, std::string s, ResultMode mode)
+{
+    Guard mg(*this);
+    return Awaitable<AsyncQuery>(loop, handle, std::move(s), mode, alive);
 }
 
-Result mysql::query(std::string s) {
-    std::lock_guard<std::mutex> mg(mutex);
-    int x = mysql_real_query(handle, s.c_str(), s.size());
-    if (x != 0) {
-        std::cerr << "Error: " << mysql_error(handle) << "\n";
-        return Result{};
-    }
-    return use_result();
+inline
+Awaitable<AsyncPrepare> mysql::prepare(EventLoop& loop, std::string s)
+{
+    Guard mg(*this);
+    return Awaitable<AsyncPrepare>(loop, handle, std::move(s), observer, alive, cache, &owner, database,
+                                   &session_scope);
+}
+
+inline
+StreamAwaitable mysql::stream(EventLoop& loop, std::string s)
+{
+    Guard mg(*this);
+    return StreamAwaitable(loop, handle, std::move(s), alive);
 }
+#endif
 
 #endif
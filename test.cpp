@@ -1,13 +1,21 @@
 #include <string>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <tuple>
+#include <vector>
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include "mysql.hpp"
 
 void fetch_from_test(mysql& sql) {
     Result r = sql.query("SELECT `id`, `name` FROM `test`");
     if (!r) return;
     while (Row row = r.next()) {
-        std::cout << std::stoi(row[0]) << "\t" << row[1] << "\n";
+        std::cout << row.get<int>(0) << "\t" << row[1] << "\n";
     }
 }
 
@@ -29,12 +37,516 @@ void delete_from_test(mysql& sql) {
     }
 }
 
+// run a statement that returns no rows
+bool run(mysql& sql, const std::string& s) {
+    sql.query(s);
+    return mysql_errno(sql.native_handle()) == 0;
+}
+
+// first column of the first row of r as a number, or -1
+long long scalar(Result r) {
+    if (!r) return -1;
+    Row row = r.fetch_row();
+    long long x;
+    return row && row.get(0, x) ? x : -1;
+}
+
+// a second lease times out while the only connection is out, and the
+// connection comes back rolled back, or reset with reset_connection
+bool pool_acquire_release() {
+    PoolOptions opts;
+    opts.max_size = 1;
+    opts.acquire_timeout = std::chrono::milliseconds(200);
+    ConnectionPool pool("localhost", "test", "test", "test", 0, "", 0, opts);
+    {
+        ConnectionPool::Lease a = pool.acquire();
+        if (!a || !run(*a, "CREATE TEMPORARY TABLE `pool_t` (`id` INT) ENGINE=InnoDB")
+            || !run(*a, "START TRANSACTION") || !run(*a, "INSERT INTO `pool_t` VALUES (1)")) {
+            std::cerr << "FAILED: pool connection setup\n";
+            return false;
+        }
+        auto start = std::chrono::steady_clock::now();
+        ConnectionPool::Lease b = pool.acquire();
+        if (b || std::chrono::steady_clock::now() - start < opts.acquire_timeout) {
+            std::cerr << "FAILED: acquire from an exhausted pool did not time out\n";
+            return false;
+        }
+    }
+    if (pool.size() != 1 || pool.idle_count() != 1) {
+        std::cerr << "FAILED: released connection not back in the pool\n";
+        return false;
+    }
+    {
+        ConnectionPool::Lease a = pool.acquire();
+        if (!a || scalar(a->query("SELECT COUNT(*) FROM `pool_t`")) != 0) {
+            std::cerr << "FAILED: released connection was not rolled back\n";
+            return false;
+        }
+    }
+
+    opts.reset_connection = true;
+    ConnectionPool full("localhost", "test", "test", "test", 0, "", 0, opts);
+    {
+        ConnectionPool::Lease a = full.acquire();
+        if (!a || !run(*a, "SET @pool_v = 1")) return false;
+    }
+    ConnectionPool::Lease a = full.acquire();
+    if (!a || scalar(a->query("SELECT @pool_v IS NULL")) != 1) {
+        std::cerr << "FAILED: released connection was not reset\n";
+        return false;
+    }
+    return true;
+}
+
+// a scan of a table that isn't there must fail, not come back empty
+bool scan_missing_table_fails() {
+    ConnectionPool pool("localhost", "test", "test", "test", 0, "", 0);
+    bool ok = parallel_scan(pool, "no_such_table", "id", "SELECT 1 FROM `no_such_table` WHERE `id` BETWEEN {lo} AND {hi}",
+                            [](size_t, Result&) { return true; });
+    if (ok) std::cerr << "FAILED: parallel_scan of a missing table succeeded\n";
+    return !ok;
+}
+
+// a cached statement is handed out again until it falls out of the LRU,
+// and stays usable after that
+bool stmt_cache_hit_and_eviction(mysql& sql) {
+    sql.set_stmt_cache_size(2);
+    std::shared_ptr<Stmt> one = sql.prepare_cached("SELECT 1");
+    bool ok = one && sql.prepare_cached("SELECT 1") == one;
+    if (!ok) std::cerr << "FAILED: cached statement not reused\n";
+    sql.prepare_cached("SELECT 2");
+    sql.prepare_cached("SELECT 3");
+    if (ok && sql.prepare_cached("SELECT 1") == one) {
+        std::cerr << "FAILED: least recently used statement not evicted\n";
+        ok = false;
+    }
+    int x = 0;
+    if (ok && !(one->execute() && one->fetch(x) && x == 1 && !one->fetch(x))) {
+        std::cerr << "FAILED: evicted statement not usable\n";
+        ok = false;
+    }
+    sql.set_stmt_cache_size(32);
+    return ok;
+}
+
+// values come back in their C++ types, strings longer than the first
+// buffer included
+bool typed_fetch(mysql& sql) {
+    Stmt s = sql.prepare("SELECT CAST(? AS SIGNED), CONCAT(?, 'b'), 2.5e0, NULL");
+    std::string a(1000, 'a');
+    long long n = 0;
+    std::string text, null;
+    double d = 0;
+    if (!s || !s.execute(-42, a) || !s.fetch(n, text, d, null)) {
+        std::cerr << "FAILED: typed fetch\n";
+        return false;
+    }
+    if (n != -42 || text != a + "b" || d != 2.5 || !null.empty() || !s.is_null(3) || s.is_null(0)
+        || s.fetch(n, text, d, null)) {
+        std::cerr << "FAILED: typed fetch returned wrong values\n";
+        return false;
+    }
+    Stmt r = sql.prepare("SELECT 1 UNION ALL SELECT 2 UNION ALL SELECT 3");
+    int sum = 0;
+    if (r && r.execute()) {
+        for (auto& [x] : r.rows<int>()) sum += x;
+    }
+    if (sum != 6) {
+        std::cerr << "FAILED: typed row iteration\n";
+        return false;
+    }
+    return true;
+}
+
+// rows too large for one packet are split into several chunks, and the
+// affected rows of all of them are added up
+bool batch_across_chunks(mysql& sql) {
+    if (!run(sql, "CREATE TEMPORARY TABLE `batch_rows` (`id` INT, `payload` MEDIUMTEXT)")) return false;
+    // 300 rows of 64 KiB exceed the 16 MiB a chunk is capped at
+    std::vector<std::tuple<int, std::string>> rows;
+    for (int i = 1; i <= 300; i++) rows.emplace_back(i, std::string(64 * 1024, 'a' + i % 26));
+    Stmt insert = sql.prepare("INSERT INTO `batch_rows` (`id`, `payload`) VALUES (?, ?)");
+    long long n = insert ? insert.execute_batch(rows) : -1;
+    if (n != 300 || scalar(sql.query("SELECT COUNT(*) FROM `batch_rows`")) != 300
+        || scalar(sql.query("SELECT SUM(`id`) FROM `batch_rows`")) != 300 * 301 / 2
+        || scalar(sql.query("SELECT SUM(LENGTH(`payload`)) FROM `batch_rows`")) != 300 * 64 * 1024) {
+        std::cerr << "FAILED: execute_batch across chunks inserted " << n << " rows\n";
+        return false;
+    }
+    // not an INSERT ... VALUES: one execute per row
+    Stmt remove = sql.prepare("DELETE FROM `batch_rows` WHERE `id` = ?");
+    if (!remove || remove.execute_batch(std::vector<int>{1, 2, 3, 1000}) != 3) {
+        std::cerr << "FAILED: execute_batch of a DELETE\n";
+        return false;
+    }
+    return true;
+}
+
+// a buffered result frees the connection for other queries at once; a
+// streaming one reads the same rows as they come
+bool result_modes(mysql& sql) {
+    const char* q = "SELECT 1 UNION ALL SELECT 2 UNION ALL SELECT 3";
+    Result buffered = sql.query(q, ResultMode::buffered);
+    if (!buffered || !buffered.is_buffered() || buffered.num_rows() != 3) {
+        std::cerr << "FAILED: buffered query\n";
+        return false;
+    }
+    // runs while buffered still has all its rows to read
+    if (scalar(sql.query("SELECT 4")) != 4) {
+        std::cerr << "FAILED: query after a buffered result\n";
+        return false;
+    }
+    long long sum = 0;
+    while (Row row = buffered.next()) sum += row.get<int>(0);
+    if (sum != 6 || !buffered.seek(2) || buffered.next().get<int>(0) != 3) {
+        std::cerr << "FAILED: reading a buffered result\n";
+        return false;
+    }
+    Result streaming = sql.query(q);
+    if (!streaming || streaming.is_buffered()) {
+        std::cerr << "FAILED: streaming query\n";
+        return false;
+    }
+    sum = 0;
+    while (Row row = streaming.next()) sum += row.get<int>(0);
+    if (sum != 6) {
+        std::cerr << "FAILED: reading a streaming result\n";
+        return false;
+    }
+    return true;
+}
+
+// each statement of a batch gets its own result, the error goes to the
+// statement that failed, and multiple statements are off again afterwards
+bool batch_results(mysql& sql) {
+    Batch ok;
+    ok.add("CREATE TEMPORARY TABLE `batch_t` (`id` INT)")
+      .add("INSERT INTO `batch_t` VALUES (1), (2)")
+      .add("SELECT COUNT(*) FROM `batch_t`");
+    std::vector<BatchResult> r = sql.execute(ok);
+    if (r.size() != 3 || !r[0].executed || r[0].error || r[1].affected_rows != 2 || !r[2].result
+        || r[2].result.fetch_row().get<int>(0) != 2) {
+        std::cerr << "FAILED: batch results\n";
+        return false;
+    }
+    Batch bad;
+    bad.add("SELECT 1").add("SELECT * FROM `no_such_table`").add("INSERT INTO `batch_t` VALUES (3)");
+    r = sql.execute(bad);
+    if (r.size() != 3 || r[0].error || !r[0].result || !r[1].executed || r[1].error == 0 || r[2].executed
+        || scalar(sql.query("SELECT COUNT(*) FROM `batch_t`")) != 2) {
+        std::cerr << "FAILED: batch error attributed to the wrong statement\n";
+        return false;
+    }
+    sql.query("SELECT 1; SELECT 2");
+    if (mysql_errno(sql.native_handle()) == 0) {
+        std::cerr << "FAILED: multiple statements left on after a batch\n";
+        return false;
+    }
+    return true;
+}
+
+// parameters bound once with param<T>() are sent again with each execute,
+// also after the statement is moved, and an empty optional is NULL
+bool reused_params(mysql& sql) {
+    if (!run(sql, "CREATE TEMPORARY TABLE `param_t` (`id` BIGINT, `name` VARCHAR(64))")) return false;
+    Stmt s = sql.prepare("INSERT INTO `param_t` (`id`, `name`) VALUES (?, ?)");
+    if (!s) return false;
+    long long& id = s.param<long long>(0);
+    std::string& name = s.param<std::string>(1);
+    for (id = 1; id <= 3; id++) {
+        name = std::string(id * 20, 'x');
+        if (!s.execute()) return false;
+    }
+    Stmt moved = std::move(s);
+    id = 4;
+    moved.set_null(1);
+    if (!moved.execute()
+        || scalar(sql.query("SELECT SUM(LENGTH(`name`)) FROM `param_t` WHERE `id` <= 3")) != 120
+        || scalar(sql.query("SELECT COUNT(*) FROM `param_t` WHERE `id` = 4 AND `name` IS NULL")) != 1) {
+        std::cerr << "FAILED: reused parameter buffers\n";
+        return false;
+    }
+    Stmt q = sql.prepare("SELECT ? IS NULL, ? IS NULL");
+    int a = 0, b = 0;
+    if (!q || !q.execute(std::optional<int>(), std::optional<int>(1)) || !q.fetch(a, b) || a != 1 || b != 0) {
+        std::cerr << "FAILED: optional parameters\n";
+        return false;
+    }
+    return true;
+}
+
+// a value sent in chunks with long_data() reads back whole with
+// stream_column(), and from an istream with StreamChunks
+bool long_data_round_trip(mysql& sql) {
+    if (!run(sql, "CREATE TEMPORARY TABLE `blob_t` (`id` INT, `data` LONGBLOB)")) return false;
+    std::string payload;
+    for (int i = 0; payload.size() < (3 << 20); i++) payload += std::to_string(i) + ",";
+    size_t sent = 0;
+    auto next = [&]() {
+        std::string_view chunk(payload.data() + sent, std::min<size_t>(100000, payload.size() - sent));
+        sent += chunk.size();
+        return chunk;
+    };
+    std::istringstream in(payload);
+    Stmt insert = sql.prepare("INSERT INTO `blob_t` (`id`, `data`) VALUES (?, ?)");
+    if (!insert || !insert.execute(1, long_data(next)) || !insert.execute(2, long_data(StreamChunks(in, 65536)))) {
+        std::cerr << "FAILED: sending long data\n";
+        return false;
+    }
+    Stmt select = sql.prepare("SELECT `data` FROM `blob_t` ORDER BY `id`");
+    if (!select || !select.execute()) return false;
+    LongColumn c;
+    for (int n = 0; n < 2; n++) {
+        std::string out;
+        if (!select.fetch(c) || c.length != payload.size()
+            || !select.stream_column(c, [&](std::string_view chunk) { out.append(chunk); }) || out != payload) {
+            std::cerr << "FAILED: long data round trip of row " << n + 1 << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// keeps what it was told about each operation
+class RecordingObserver : public QueryObserver {
+    public:
+        struct Seen {
+            QueryKind kind;
+            std::string sql;
+            uint64_t rows;
+            unsigned int error;
+        };
+        std::vector<Seen> seen;
+
+        void observe(const QueryStats& stats) override {
+            seen.push_back(Seen{stats.kind, std::string(stats.sql), stats.rows, stats.error});
+        }
+};
+
+// the observer hears of every connect, query, prepare and execute, with
+// rows counted and errors reported to it
+bool observer_callbacks() {
+    RecordingObserver observer;
+    LatencyHistogram histogram;
+    mysql conn;
+    conn.set_observer(&observer);
+    if (!conn.connect("localhost", "test", "test", "test", 0, 0, 0)) return false;
+    {
+        Result r = conn.query("SELECT 1 UNION ALL SELECT 2");
+        while (r.next()) {}
+    }
+    conn.query("SELECT * FROM `no_such_table`");
+    Stmt s = conn.prepare("SELECT ?");
+    int x = 0;
+    bool ok = s && s.execute(7) && s.fetch(x);
+    if (!ok || observer.seen.size() != 5
+        || observer.seen[0].kind != QueryKind::connect
+        || observer.seen[1].kind != QueryKind::query || observer.seen[1].rows != 2 || observer.seen[1].error
+        || observer.seen[2].kind != QueryKind::query || observer.seen[2].error == 0
+        || observer.seen[3].kind != QueryKind::prepare || observer.seen[3].sql != "SELECT ?"
+        || observer.seen[4].kind != QueryKind::execute) {
+        std::cerr << "FAILED: observer callbacks\n";
+        return false;
+    }
+    conn.set_observer(&histogram);
+    for (int i = 0; i < 5; i++) conn.query("SELECT 1", ResultMode::buffered);
+    std::vector<LatencyHistogram::Entry> entries = histogram.snapshot();
+    if (entries.size() != 1 || entries[0].count != 5 || histogram.percentile("SELECT 1", 0.5).count() <= 0) {
+        std::cerr << "FAILED: latency histogram\n";
+        return false;
+    }
+    return true;
+}
+
+// is_open() does not ask the server, so it only turns false once a call
+// met the killed connection
+bool liveness_after_kill(mysql& sql) {
+    mysql conn;
+    if (!conn.connect("localhost", "test", "test", "test", 0, 0, 0)) return false;
+    long long id = scalar(conn.query("SELECT CONNECTION_ID()"));
+    if (!conn.is_open() || !run(sql, "KILL " + std::to_string(id))) {
+        std::cerr << "FAILED: killing a connection\n";
+        return false;
+    }
+    if (!conn.is_open()) {
+        std::cerr << "FAILED: is_open() asked the server\n";
+        return false;
+    }
+    if (scalar(conn.query("SELECT 1")) != -1 || conn.is_open() || conn.ping()) {
+        std::cerr << "FAILED: killed connection still open\n";
+        return false;
+    }
+    return true;
+}
+
+// reads go to the replica until the session writes, then to the primary
+// for pin_for; the same server stands in for both
+bool cluster_routing() {
+    ClusterOptions opts;
+    opts.pool.min_size = 0;
+    opts.pin_for = std::chrono::milliseconds(300);
+    Cluster cluster("test", "test", "test", 0, Endpoint{"localhost"}, {Endpoint{"localhost"}}, opts);
+    Cluster::Session session = cluster.session();
+    long long replica = scalar(session.query("SELECT CONNECTION_ID()"));
+    if (replica == -1 || cluster.replica_pool(0).size() != 1 || cluster.primary_pool().size() != 0
+        || cluster.replica_latency(0).count() == 0) {
+        std::cerr << "FAILED: read not sent to the replica\n";
+        return false;
+    }
+    session.query("SET @cluster_w = 1");
+    if (cluster.primary_pool().size() != 1 || !session.pinned()) {
+        std::cerr << "FAILED: write not sent to the primary\n";
+        return false;
+    }
+    long long primary = scalar(session.query("SELECT CONNECTION_ID()"));
+    if (primary == replica || scalar(session.query("SELECT @cluster_w")) != 1) {
+        std::cerr << "FAILED: read after a write not pinned to the primary\n";
+        return false;
+    }
+    std::this_thread::sleep_for(opts.pin_for);
+    if (session.pinned() || scalar(session.query("SELECT CONNECTION_ID()")) != replica) {
+        std::cerr << "FAILED: reads not back on the replica after pin_for\n";
+        return false;
+    }
+    return true;
+}
+
+// a cursor hands out every row in order, prefetch at a time, and the
+// statement runs without one again after close_cursor()
+bool cursor_fetch(mysql& sql) {
+    std::string q = "INSERT INTO `cursor_t` VALUES (1)";
+    for (int i = 2; i <= 2500; i++) q += ", (" + std::to_string(i) + ")";
+    if (!run(sql, "CREATE TEMPORARY TABLE `cursor_t` (`id` INT)") || !run(sql, q)) return false;
+    Stmt s = sql.prepare("SELECT `id` FROM `cursor_t` ORDER BY `id`");
+    if (!s || !s.open_cursor(100) || !s.execute()) {
+        std::cerr << "FAILED: opening a cursor\n";
+        return false;
+    }
+    int id, n = 0;
+    while (s.fetch(id) && id == n + 1) n++;
+    if (n != 2500 || !s.close_cursor() || !s.execute() || !s.fetch(id) || id != 1) {
+        std::cerr << "FAILED: cursor fetch stopped after " << n << " rows\n";
+        return false;
+    }
+    return true;
+}
+
+// each thread gets its own connection from local(), bound to it, and the
+// same one on every call until it releases it
+bool thread_local_connections() {
+    PoolOptions opts;
+    opts.max_size = 2;
+    ConnectionPool pool("localhost", "test", "test", "test", 0, "", 0, opts);
+    long long ids[2] = {-1, -1};
+    bool ok[2] = {false, false};
+    std::atomic<int> holding{0};
+    auto work = [&](int i) {
+        mysql* conn = pool.local();
+        if (conn && conn->thread_affine() && pool.local() == conn) {
+            ids[i] = scalar(conn->query("SELECT CONNECTION_ID()"));
+            Stmt s = conn->prepare("SELECT ?");
+            int x = 0;
+            ok[i] = s && s.execute(i) && s.fetch(x) && x == i;
+        }
+        // both hold theirs at once, so they can't be handed the same one
+        holding++;
+        while (holding < 2) std::this_thread::yield();
+        pool.release_local();
+    };
+    std::thread a(work, 0), b(work, 1);
+    a.join();
+    b.join();
+    if (!ok[0] || !ok[1] || ids[0] == -1 || ids[0] == ids[1] || pool.idle_count() != 2) {
+        std::cerr << "FAILED: thread-local connections\n";
+        return false;
+    }
+    return true;
+}
+
+// compression is negotiated when asked for, and a read or connect that
+// takes longer than its timeout fails instead of waiting
+bool connect_options() {
+    ConnectOptions opts;
+    opts.compression = Compression::zlib;
+    opts.read_timeout = std::chrono::seconds(1);
+    mysql conn;
+    if (!conn.connect("localhost", "test", "test", "test", 0, 0, 0, opts)) return false;
+    Result r = conn.query("SHOW SESSION STATUS LIKE 'Compression'", ResultMode::buffered);
+    Row row = r ? r.fetch_row() : Row{};
+    if (!row || row[1] != "ON") {
+        std::cerr << "FAILED: compression not on\n";
+        return false;
+    }
+    // MySQL retries a timed out read twice, so this fails after 3 seconds
+    auto start = std::chrono::steady_clock::now();
+    if (scalar(conn.query("SELECT SLEEP(10)")) != -1 || conn.is_open()
+        || std::chrono::steady_clock::now() - start > std::chrono::seconds(8)) {
+        std::cerr << "FAILED: read_timeout not applied\n";
+        return false;
+    }
+    // a non-routable address, so the handshake never starts
+    ConnectOptions unreachable;
+    unreachable.connect_timeout = std::chrono::seconds(1);
+    mysql lost;
+    start = std::chrono::steady_clock::now();
+    if (lost.connect("10.255.255.1", "test", "test", "test", 0, 0, 0, unreachable)
+        || std::chrono::steady_clock::now() - start > std::chrono::seconds(8)) {
+        std::cerr << "FAILED: connect_timeout not applied\n";
+        return false;
+    }
+    return true;
+}
+
+// after KILL CONNECTION_ID() the next call reconnects, with the session
+// variables set again and the statement cache prepared again
+bool reconnect_replays_session() {
+    mysql conn;
+    if (!conn.connect("localhost", "test", "test", "test", 0, 0, 0)) return false;
+    conn.set_reconnect(ReconnectOptions());
+    std::shared_ptr<Stmt> old = conn.prepare_cached("SELECT @@session.sql_mode");
+    long long id = scalar(conn.query("SELECT CONNECTION_ID()"));
+    if (!conn.set_session("sql_mode", "'ANSI_QUOTES'") || !old) return false;
+    conn.query("KILL CONNECTION_ID()");
+    // finds the connection lost, so the call after it reconnects
+    conn.ping();
+    Result r = conn.query("SELECT @@session.sql_mode, CONNECTION_ID()", ResultMode::buffered);
+    Row row = r ? r.fetch_row() : Row{};
+    if (!row || row[0] != "ANSI_QUOTES" || row.get<long long>(1) == id) {
+        std::cerr << "FAILED: session not replayed after reconnect\n";
+        return false;
+    }
+    std::shared_ptr<Stmt> again = conn.prepare_cached("SELECT @@session.sql_mode");
+    std::string mode;
+    if (!old->stale() || !again || again == old || again->stale() || !again->execute() || !again->fetch(mode)
+        || mode != "ANSI_QUOTES") {
+        std::cerr << "FAILED: statement cache not prepared again after reconnect\n";
+        return false;
+    }
+    return true;
+}
+
 int main()
 {
     mysql sql{};
     if (!sql.connect("localhost", "test", "test", "test", 0, 0, 0)) {
         return 1;
     }
+    if (!scan_missing_table_fails()) return 1;
+    if (!pool_acquire_release()) return 1;
+    if (!stmt_cache_hit_and_eviction(sql)) return 1;
+    if (!typed_fetch(sql)) return 1;
+    if (!batch_across_chunks(sql)) return 1;
+    if (!result_modes(sql)) return 1;
+    if (!batch_results(sql)) return 1;
+    if (!reused_params(sql)) return 1;
+    if (!long_data_round_trip(sql)) return 1;
+    if (!observer_callbacks()) return 1;
+    if (!liveness_after_kill(sql)) return 1;
+    if (!cluster_routing()) return 1;
+    if (!cursor_fetch(sql)) return 1;
+    if (!thread_local_connections()) return 1;
+    if (!connect_options()) return 1;
+    if (!reconnect_replays_session()) return 1;
     fetch_from_test(sql);
     //delete_from_test(sql);
     insert_into_test(sql);
@@ -0,0 +1,464 @@
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <cstdio>
+#include <unistd.h>
+#include <functional>
+#include "mysql.hpp"
+
+// Checks of the parts of mysql.hpp that need no server.
+
+int failures = 0;
+
+void expect(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+void column_layout_checks() {
+    MYSQL_FIELD fields[4] = {};
+    const char* names[] = {"id", "name", "id", "Name"};
+    for (size_t i = 0; i < 4; i++) fields[i].name = (char*)names[i];
+    ColumnLayout layout(fields, 4);
+    expect(layout.size() == 4 && layout.name(2) == "id", "layout names");
+    expect(layout.find("id") == 2, "duplicate name: the last wins");
+    expect(layout.find("name") == 1 && layout.find("Name") == 3, "names are case sensitive");
+    expect(layout.find("i") == ColumnLayout::npos && layout.find("ids") == ColumnLayout::npos
+           && layout.find("") == ColumnLayout::npos && layout.find("zzz") == ColumnLayout::npos, "missing names");
+    expect(ColumnLayout().find("id") == ColumnLayout::npos, "empty layout");
+}
+
+// every special byte at every position, on both sides of the 16-byte blocks
+void escape_checks() {
+    const char special[] = {'\0', '\n', '\r', '\\', '\'', '"', '`', '\032'};
+    for (size_t n = 0; n <= 64; n++) {
+        std::string s(n, 'a');
+        expect(!needs_escape(s.data(), n) && !needs_escape_scalar(s.data(), n), "plain " + std::to_string(n));
+        for (size_t i = 0; i < n; i++) {
+            for (char c : special) {
+                s[i] = c;
+                expect(needs_escape(s.data(), n) && needs_escape_scalar(s.data(), n),
+                       "special " + std::to_string((int)c) + " at " + std::to_string(i) + " of " + std::to_string(n));
+                s[i] = (char)(c | 0x80);
+                expect(!needs_escape(s.data(), n) && !needs_escape_scalar(s.data(), n),
+                       "high " + std::to_string((int)c) + " at " + std::to_string(i) + " of " + std::to_string(n));
+                s[i] = 'a';
+            }
+        }
+    }
+    uint32_t x = 1;
+    for (int k = 0; k < 10000; k++) {
+        char s[40];
+        for (char& c : s) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            c = (char)(x % 96 + 32);
+        }
+        size_t n = x % sizeof(s);
+        expect(needs_escape(s, n) == needs_escape_scalar(s, n), "random " + std::string(s, n));
+    }
+    // identifiers are escaped alike on every client library
+    mysql db;
+    std::string id = "[";
+    expect(db.escape("a`b``c\\'\n", id, '`') == 12 && id == "[a``b````c\\'\n", "escape identifier");
+    id.clear();
+    expect(db.escape("plain", id, '`') == 5 && id == "plain", "escape plain identifier");
+}
+
+template <class T>
+bool parses(const std::string& s, T expected) {
+    T v{};
+    return parse_value(s.data(), s.size(), v) && v == expected;
+}
+
+template <class T>
+bool rejects(const std::string& s) {
+    T v{};
+    return !parse_value(s.data(), s.size(), v);
+}
+
+void parse_value_checks() {
+    expect(parses<int>("0", 0), "int 0");
+    expect(parses<int>("-5", -5), "int -5");
+    expect(parses<int>("+5", 5), "int +5");
+    expect(parses<int>("12345678", 12345678), "int eight digits");
+    expect(parses<long long>("1234567890123456789", 1234567890123456789LL), "long long 19 digits");
+    expect(parses<long long>("-9223372036854775808", INT64_MIN), "long long min");
+    expect(parses<long long>("9223372036854775807", INT64_MAX), "long long max");
+    expect(rejects<long long>("9223372036854775808"), "long long max + 1");
+    expect(parses<unsigned long long>("18446744073709551615", UINT64_MAX), "uint64 max");
+    expect(rejects<unsigned long long>("18446744073709551616"), "uint64 overflow");
+    expect(rejects<unsigned long long>("99999999999999999999"), "uint64 far overflow");
+    expect(rejects<unsigned>("-1"), "unsigned -1");
+    expect(rejects<unsigned char>("256"), "unsigned char 256");
+    expect(parses<int>("0000000000000000000000042", 42), "leading zeros beyond 19 digits");
+    expect(parses<int>("-0000000000000000000000042", -42), "negative leading zeros");
+    expect(parses<int>("+0000000000000000000000042", 42), "plus leading zeros");
+    expect(rejects<int>("+-5"), "int +-5");
+    expect(rejects<int>("-+5"), "int -+5");
+    expect(rejects<int>("++5"), "int ++5");
+    expect(rejects<int>("-"), "int -");
+    expect(rejects<int>("+"), "int +");
+    expect(rejects<int>(""), "int empty");
+    expect(rejects<int>("12a45678"), "int letter in a word");
+    expect(rejects<int>("1234567/"), "int '/' in a word");
+    expect(rejects<int>("1234567:"), "int ':' in a word");
+    expect(rejects<int>(" 5"), "int leading space");
+    // every word position, and the bytes either side of '0'..'9'
+    for (size_t i = 0; i < 16; i++) {
+        for (char c : {'/', ':', ' ', '\0', '\xb0'}) {
+            std::string s(16, '7');
+            s[i] = c;
+            expect(rejects<long long>(s), "non-digit at " + std::to_string(i));
+        }
+    }
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 10000; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t v = x >> (i % 64);
+        std::string s = std::to_string(v);
+        expect(parses<unsigned long long>(s, v), "uint64 " + s);
+    }
+    expect(parses<double>("1.5", 1.5), "double 1.5");
+    expect(parses<double>("+1.5", 1.5), "double +1.5");
+    expect(parses<double>("-1.5", -1.5), "double -1.5");
+    expect(rejects<double>("+-1.5"), "double +-1.5");
+    expect(rejects<double>("+"), "double +");
+}
+
+// count_placeholders is constexpr, so these fail the build rather than the run
+static_assert(count_placeholders("") == 0);
+static_assert(count_placeholders("SELECT ?, ?") == 2);
+static_assert(count_placeholders("SELECT ?--?") == 2);
+static_assert(count_placeholders("SELECT '?', ?") == 1);
+static_assert(count_placeholders("SELECT 'it''s ?', ?") == 1);
+static_assert(count_placeholders("SELECT 'a\\'?', ?") == 1);
+static_assert(count_placeholders("SELECT \"?\", `?`, ?") == 1);
+static_assert(count_placeholders("SELECT `a\\`, ?") == 1);
+static_assert(count_placeholders("SELECT ? # ?\n, ?") == 2);
+static_assert(count_placeholders("SELECT ? -- ?\n, ?") == 2);
+static_assert(count_placeholders("SELECT /* ? */ ?") == 1);
+static_assert(count_placeholders("SELECT ? /* ?") == 1);
+static_assert(count_placeholders("SELECT '?") == 0);
+static_assert(count_placeholders("SELECT ? /*! , ? */") == 2);
+static_assert(count_placeholders("SELECT ? /*!50700 , ? */, ?") == 3);
+static_assert(count_placeholders("SELECT ? /*M!100100 , '?' */") == 1);
+static_assert(count_placeholders("SELECT ? /*+ ? */") == 1);
+
+// moving a lease or a session only hands over connections and never throws
+static_assert(std::is_nothrow_move_constructible_v<ConnectionPool::Lease>);
+static_assert(std::is_nothrow_move_assignable_v<ConnectionPool::Lease>);
+static_assert(std::is_nothrow_move_constructible_v<Cluster::Session>);
+static_assert(std::is_nothrow_move_assignable_v<Cluster::Session>);
+
+void histogram_checks() {
+    for (size_t b = 0; b + 1 < LatencyHistogram::buckets; b++) {
+        uint64_t top = LatencyHistogram::upper(b);
+        expect(LatencyHistogram::bucket(top) == b, "bucket of upper " + std::to_string(b));
+        expect(LatencyHistogram::bucket(top + 1) == b + 1, "bucket past upper " + std::to_string(b));
+    }
+    expect(LatencyHistogram::upper(LatencyHistogram::buckets - 1) == UINT64_MAX, "last upper");
+    expect(LatencyHistogram::bucket(UINT64_MAX) == LatencyHistogram::buckets - 1, "last bucket");
+}
+
+void sql_checks() {
+    expect(is_read_only("SELECT 1"), "SELECT 1");
+    expect(is_read_only("  /* hint */ select a FROM t;"), "comment first, trailing semicolon");
+    expect(is_read_only("SELECT a FROM t -- FOR UPDATE\n"), "FOR UPDATE in a comment");
+    expect(is_read_only("SELECT 'FOR UPDATE', \"INTO\" FROM t"), "FOR UPDATE and INTO in strings");
+    expect(is_read_only("SELECT `for`, `update` FROM t"), "quoted identifiers");
+    expect(!is_read_only("SELECT a FROM t FOR UPDATE"), "FOR UPDATE");
+    expect(!is_read_only("SELECT a FROM t for share"), "FOR SHARE");
+    expect(!is_read_only("SELECT a FROM t LOCK IN SHARE MODE"), "LOCK IN SHARE MODE");
+    expect(!is_read_only("SELECT a INTO @x FROM t"), "INTO a variable");
+    expect(!is_read_only("SELECT a FROM t INTO OUTFILE '/tmp/x'"), "INTO OUTFILE");
+    expect(!is_read_only("SELECT 1; DELETE FROM t"), "two statements");
+    expect(!is_read_only("UPDATE t SET a = 1"), "UPDATE");
+    expect(!is_read_only("/* SELECT */ DELETE FROM t"), "SELECT in a comment");
+
+    typedef std::vector<std::string> names;
+    expect(tables_of("SELECT * FROM `Orders` o JOIN db.items AS i ON o.id = i.order_id") == names{"orders", "items"},
+           "tables of a join");
+    expect(tables_of("SELECT a FROM t WHERE b = 'FROM u' -- JOIN v\n") == names{"t"}, "tables in a string and comment");
+    expect(tables_of("SELECT a FROM t /* JOIN v */ WHERE c IN (SELECT c FROM w)") == names{"t", "w"},
+           "tables of a subquery");
+    expect(tables_of("SELECT * FROM `my table`, `db`.`Other`") == names{"my table", "other"}, "quoted tables");
+    expect(tables_of("INSERT INTO t (a) VALUES (1)") == names{"t"}, "tables of INSERT");
+    expect(tables_of("UPDATE LOW_PRIORITY a, b SET a.x = b.x") == names{"a", "b"}, "tables of UPDATE");
+    expect(tables_of("REPLACE INTO t SELECT * FROM u") == names{"t", "u"}, "tables of REPLACE ... SELECT");
+    expect(tables_of("DELETE FROM t WHERE id = 1; SELECT * FROM u") == names{"t", "u"}, "tables of two statements");
+    expect(tables_of("TRUNCATE TABLE t") == names{"t"}, "tables of TRUNCATE");
+    expect(tables_of("LOAD DATA LOCAL INFILE 'bulk_load' INTO TABLE `Db`.`Orders` CHARACTER SET utf8mb4"
+                     " FIELDS TERMINATED BY '\\t' (`id`, `note`)") == names{"orders"},
+           "tables of LOAD DATA");
+    expect(tables_of("SELECT 1").empty(), "no tables");
+}
+
+// value in a single column "v", one row per value
+std::shared_ptr<const RowSet> rows_of(const std::vector<std::string>& values) {
+    MYSQL_FIELD field = {};
+    field.name = (char*)"v";
+    auto rows = std::make_shared<RowSet>(std::make_shared<ColumnLayout>(&field, 1));
+    for (const std::string& v : values) {
+        char* cell = (char*)v.c_str();
+        unsigned long length = v.size();
+        rows->append(&cell, &length);
+    }
+    return rows;
+}
+
+void result_cache_checks() {
+    ResultCache cache(1 << 20, std::chrono::seconds(60), 4);
+    cache.put("a", rows_of({"1", "2"}), {"T"}, cache.ticket());
+    cache.put("b", rows_of({"3"}), {"u"}, cache.ticket());
+    std::shared_ptr<const RowSet> a = cache.get("a");
+    expect(a && a->size() == 2 && (*a)[1].view(0) == "2", "cached rows");
+    expect(!cache.get("c"), "missing key");
+    expect(cache.hits() == 1 && cache.misses() == 1, "hit and miss counts");
+
+    // table names are matched without case, and only theirs go
+    cache.invalidate("t");
+    expect(!cache.get("a") && cache.get("b"), "invalidate one table");
+    expect(a && a->size() == 2, "rows outlive their entry");
+    cache.invalidate(std::vector<std::string>{"x", "U"});
+    expect(!cache.get("b") && cache.size() == 0, "invalidate a list");
+
+    // an invalidation of its table after the ticket was taken keeps the
+    // rows out
+    uint64_t ticket = cache.ticket();
+    cache.invalidate("T");
+    cache.put("a", rows_of({"1"}), {"t"}, ticket);
+    expect(!cache.get("a"), "stale ticket");
+    ticket = cache.ticket();
+    cache.clear();
+    cache.put("a", rows_of({"1"}), {"t"}, ticket);
+    expect(!cache.get("a"), "stale ticket after clear");
+    cache.put("a", rows_of({"1"}), {"t"}, cache.ticket());
+    expect(!!cache.get("a"), "fresh ticket");
+    // but one of another table does not
+    ticket = cache.ticket();
+    cache.invalidate("other");
+    cache.put("b", rows_of({"1"}), {"t", "u"}, ticket);
+    expect(!!cache.get("b"), "ticket of other tables");
+    cache.invalidate("U");
+    cache.put("c", rows_of({"1"}), {"t", "u"}, ticket);
+    expect(!cache.get("c"), "stale ticket of a second table");
+
+    cache.put("short", rows_of({"1"}), {}, cache.ticket(), std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    expect(!cache.get("short") && cache.get("a"), "ttl");
+
+    // one shard with room for three of these
+    ResultCache small(4000, std::chrono::seconds(60), 1);
+    std::string kb(1000, 'x');
+    for (const char* key : {"1", "2", "3"}) small.put(key, rows_of({kb}), {}, small.ticket());
+    expect(small.size() == 3, "lru fills");
+    small.get("1");
+    small.put("4", rows_of({kb}), {}, small.ticket());
+    expect(small.size() == 3 && small.get("1") && !small.get("2") && small.get("3") && small.get("4"),
+           "lru evicts the least recently used");
+    small.put("big", rows_of({std::string(5000, 'x')}), {}, small.ticket());
+    expect(!small.get("big") && small.size() == 3, "larger than the budget");
+    expect(small.bytes() <= 4000, "within the budget");
+
+    expect(ResultCache::normalize("SELECT  a\n FROM t ;") == ResultCache::normalize("SELECT a FROM t"),
+           "normalize space and semicolon");
+    expect(ResultCache::normalize("SELECT 'a  b'") != ResultCache::normalize("SELECT 'a b'"),
+           "normalize keeps strings");
+    expect(ResultCache::key("db", "", "SELECT 1") == ResultCache::key("db", "", "SELECT  1;"), "key normalizes");
+    expect(ResultCache::key("a", "", "SELECT 1") != ResultCache::key("b", "", "SELECT 1"), "key has the database");
+    expect(ResultCache::key("db", "time_zone = '+00:00', ", "SELECT NOW()") != ResultCache::key("db", "", "SELECT NOW()"),
+           "key has the session");
+    expect(ResultCache::key("ab", "", "SELECT 1") != ResultCache::key("a", "b", "SELECT 1"), "key parts stay apart");
+    expect(uses_database("USE `other`") && uses_database("SELECT 1; use x") && !uses_database("SELECT `use` FROM t"),
+           "USE statements");
+}
+
+std::string text(TextFormat format, const char* s, size_t n) {
+    std::string out;
+    append_text(out, format, s, n);
+    expect(out.size() <= text_bound(n), "text_bound");
+    return out;
+}
+
+std::string text(TextFormat format, const std::string& s) {
+    return text(format, s.data(), s.size());
+}
+
+void export_checks() {
+    TextFormat tsv = TextFormat::tsv, csv = TextFormat::csv;
+    expect(text(tsv, "plain") == "plain", "tsv plain");
+    expect(text(tsv, "") == "", "tsv empty");
+    expect(text(tsv, nullptr, 0) == "\\N", "tsv NULL");
+    expect(text(tsv, "\\N") == "\\\\N", "tsv backslash N is not NULL");
+    expect(text(tsv, "a\tb\nc\rd\\e") == "a\\tb\\nc\\rd\\\\e", "tsv escapes");
+    expect(text(tsv, std::string("a\0b", 3)) == "a\\0b", "tsv NUL byte");
+    expect(text(tsv, "\xc3\xa9,\"") == "\xc3\xa9,\"", "tsv leaves other bytes");
+    std::string worst(100, '\t');
+    expect(text(tsv, worst).size() == 200, "tsv worst case");
+
+    expect(text(csv, "plain") == "plain", "csv plain");
+    expect(text(csv, "") == "\"\"", "csv empty string");
+    expect(text(csv, nullptr, 0) == "", "csv NULL");
+    expect(text(csv, "a,b") == "\"a,b\"", "csv comma");
+    expect(text(csv, "say \"hi\"") == "\"say \"\"hi\"\"\"", "csv quotes");
+    expect(text(csv, "a\nb") == "\"a\nb\"" && text(csv, "a\rb") == "\"a\rb\"", "csv line breaks");
+    expect(text(csv, "a\tb\\") == "a\tb\\", "csv tab and backslash");
+    std::string quotes(100, '"');
+    expect(text(csv, quotes).size() == 202, "csv worst case");
+
+    // whole rows through an Exporter and a file
+    MYSQL_FIELD fields[2] = {};
+    fields[0].name = (char*)"id";
+    fields[1].name = (char*)"note, text";
+    RowSet rows(std::make_shared<ColumnLayout>(fields, 2));
+    const char* cells[][2] = {{"1", "a\tb"}, {"2", nullptr}, {"3", "x,\"y\""}};
+    for (auto& r : cells) {
+        char* row[2] = {(char*)r[0], (char*)r[1]};
+        unsigned long lengths[2] = {strlen(r[0]), r[1] ? strlen(r[1]) : 0};
+        rows.append(row, lengths);
+    }
+    for (TextFormat format : {tsv, csv}) {
+        FILE* f = tmpfile();
+        Exporter out(fileno(f), format, 4096, 2);
+        out.header(rows.columns());
+        for (Row r : rows) out.row(r, 2);
+        expect(out.finish(), "export finishes");
+        std::string got(256, 0);
+        got.resize(pread(fileno(f), &got[0], got.size(), 0));
+        fclose(f);
+        if (format == tsv) {
+            expect(got == "id\tnote, text\n1\ta\\tb\n2\t\\N\n3\tx,\"y\"\n", "tsv export");
+        } else {
+            expect(got == "id,\"note, text\"\n1,a\tb\n2,\n3,\"x,\"\"y\"\"\"\n", "csv export");
+        }
+    }
+}
+
+// everything LoadSource::read passes on for the rows of produce, read in
+// small pieces
+std::string loaded(std::function<bool(LoadWriter&)> produce) {
+    LoadSource source{&produce, LoadWriter(), 0, true, 0};
+    std::string out;
+    char buf[7];
+    for (int n; (n = LoadSource::read(&source, buf, sizeof(buf))) > 0;) out.append(buf, n);
+    expect(source.sent == out.size(), "load sent");
+    return out;
+}
+
+void load_writer_checks() {
+    std::string in = loaded([](LoadWriter& w) {
+        w.row(std::string("a\tb"), std::string("c\nd"), std::string("e\\f"), nullptr);
+        w.row(std::string(1, '\0'), std::string(), std::optional<int>(), 42);
+        return false;
+    });
+    expect(in == "a\\tb\tc\\nd\te\\\\f\t\\N\n\\0\t\t\\N\t42\n", "load fields");
+    int left = 3;
+    in = loaded([&](LoadWriter& w) {
+        w.row(left, std::string(20, 'x'));
+        return --left > 0;
+    });
+    expect(in == "3\t" + std::string(20, 'x') + "\n2\t" + std::string(20, 'x') + "\n1\t" + std::string(20, 'x') + "\n",
+           "load chunks");
+    std::string id;
+    append_identifier(id, "db.t");
+    expect(id == "`db`.`t`", "qualified identifier");
+    id.clear();
+    append_identifier(id, "we`ird.t");
+    expect(id == "`we``ird.t`", "quoted identifier");
+}
+
+// the ranges are in order, adjacent, and cover min..max exactly
+bool covers(const std::vector<KeyRange>& ranges, long long min, long long max) {
+    if (ranges.empty() || ranges.front().lo != min || ranges.back().hi != max) return false;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (ranges[i].hi < ranges[i].lo) return false;
+        if (i && (unsigned long long)ranges[i].lo != (unsigned long long)ranges[i - 1].hi + 1) return false;
+    }
+    return true;
+}
+
+// the widths of the ranges differ by at most two
+bool even(const std::vector<KeyRange>& ranges) {
+    unsigned long long least = ~0ULL, most = 0;
+    for (const KeyRange& r : ranges) {
+        unsigned long long w = (unsigned long long)r.hi - (unsigned long long)r.lo;
+        least = std::min(least, w);
+        most = std::max(most, w);
+    }
+    return most - least <= 2;
+}
+
+void key_range_checks() {
+    std::vector<KeyRange> r = split_range(1, 100, 7);
+    expect(r.size() == 7 && covers(r, 1, 100) && even(r), "split 1..100");
+    r = split_range(5, 5, 7);
+    expect(r.size() == 1 && covers(r, 5, 5), "split one value");
+    r = split_range(-3, 3, 10);
+    expect(r.size() == 7 && covers(r, -3, 3), "more ranges than values");
+    expect(split_range(1, 100, 0).empty() && split_range(2, 1, 4).empty(), "nothing to split");
+    for (size_t n : {1, 2, 3, 4, 7, 64, 1000}) {
+        std::string what = " into " + std::to_string(n);
+        r = split_range(INT64_MIN, INT64_MAX, n);
+        expect(r.size() == n && covers(r, INT64_MIN, INT64_MAX) && even(r), "split the full range" + what);
+        r = split_range(INT64_MIN, INT64_MIN + 10, n);
+        expect(r.size() == std::min<size_t>(n, 11) && covers(r, INT64_MIN, INT64_MIN + 10) && even(r),
+               "split near INT64_MIN" + what);
+        r = split_range(INT64_MAX - 10, INT64_MAX, n);
+        expect(r.size() == std::min<size_t>(n, 11) && covers(r, INT64_MAX - 10, INT64_MAX) && even(r),
+               "split near INT64_MAX" + what);
+        r = split_range(-1, INT64_MAX, n);
+        expect(r.size() == n && covers(r, -1, INT64_MAX) && even(r), "split across zero to INT64_MAX" + what);
+        r = split_range(INT64_MIN, 0, n);
+        expect(r.size() == n && covers(r, INT64_MIN, 0) && even(r), "split INT64_MIN to zero" + what);
+    }
+}
+
+#if MYSQL_HPP_COROUTINES
+// never run: gives make cxx20 every co_await form to compile
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}
+    };
+};
+
+Detached await_each(EventLoop& loop, mysql& db, Stmt& stmt) {
+    co_await db.connect(loop, "host", "user", "password", "db", 0, "", 0);
+    Result r = co_await db.query(loop, "SELECT 1");
+    RowStream rows = co_await db.stream(loop, "SELECT 1");
+    while (Row row = co_await rows.next()) {}
+    Stmt prepared = co_await db.prepare(loop, "SELECT ?");
+    bool ok = co_await stmt.execute(loop, 1);
+    (void)r;
+    (void)ok;
+}
+#endif
+
+int main()
+{
+    column_layout_checks();
+    escape_checks();
+    parse_value_checks();
+    histogram_checks();
+    sql_checks();
+    result_cache_checks();
+    export_checks();
+    load_writer_checks();
+    key_range_checks();
+    if (failures) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "all checks passed\n";
+}